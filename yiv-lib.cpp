@@ -3,6 +3,19 @@
 #include <random>
 #include <stdexcept>
 #include <cstring>
+#include <cmath>
+#include <climits>
+#include <thread>
+#include <atomic>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define YIV_HAVE_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // stb_image for loading all formats
 #define STB_IMAGE_IMPLEMENTATION
@@ -14,183 +27,4866 @@
 
 namespace yiv {
 
-// ==================== IMAGE ====================
-bool Image::loadFromFile(const std::string& path) {
-    int width, height, channels;
-    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 0);
-    if (!data) return false;
+// ==================== HELPERS ====================
+namespace {
 
-    m_filePath = path;
-    updatePixelData(data, width, height, channels);
-    stbi_image_free(data);
-    return true;
+// Splits [0, count) into one contiguous range per hardware thread
+template <typename Fn>
+void parallelFor(int count, Fn fn) {
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    threads = std::min(threads, count);
+    if (threads <= 1) {
+        if (count > 0) fn(0, count);
+        return;
+    }
+    std::vector<std::thread> workers;
+    int chunk = (count + threads - 1) / threads;
+    for (int begin = 0; begin < count; begin += chunk)
+        workers.emplace_back(fn, begin, std::min(count, begin + chunk));
+    for (auto& t : workers) t.join();
 }
 
-bool Image::loadPartial(const std::string& path, int x, int y, int w, int h) {
-    int width, height, channels;
-    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 0);
-    if (!data) return false;
-    if (x < 0 || y < 0 || x + w > width || y + h > height) {
-        stbi_image_free(data);
-        return false;
-    }
+// Area-average resample (box filter); degenerates to nearest when enlarging
+void boxResample(const unsigned char* src, int sw, int sh, int channels,
+                 unsigned char* dst, int dw, int dh) {
+    auto rows = [=](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            int y0 = int(int64_t(y) * sh / dh);
+            int y1 = std::max(y0 + 1, int(int64_t(y + 1) * sh / dh));
+            for (int x = 0; x < dw; ++x) {
+                int x0 = int(int64_t(x) * sw / dw);
+                int x1 = std::max(x0 + 1, int(int64_t(x + 1) * sw / dw));
+                unsigned sum[4] = {0, 0, 0, 0};
+                for (int sy = y0; sy < y1; ++sy) {
+                    const unsigned char* row = src + (size_t(sy) * sw + x0) * channels;
+                    for (int sx = x0; sx < x1; ++sx, row += channels)
+                        for (int c = 0; c < channels; ++c) sum[c] += row[c];
+                }
+                unsigned area = unsigned((y1 - y0) * (x1 - x0));
+                for (int c = 0; c < channels; ++c)
+                    dst[(size_t(y) * dw + x) * channels + c] = (unsigned char)((sum[c] + area / 2) / area);
+            }
+        }
+    };
+    // Small sources are not worth the thread start-up (and hashing already runs per image in parallel)
+    if (size_t(sw) * sh < (size_t(1) << 20)) rows(0, dh);
+    else parallelFor(dh, rows);
+}
 
-    std::vector<unsigned char> partialPixels(w * h * channels);
-    for (int row = 0; row < h; ++row) {
-        std::memcpy(&partialPixels[row * w * channels],
-                    &data[((y + row) * width + x) * channels],
-                    w * channels);
+// Same weights as FilterType::Grayscale, in 8.8 fixed point
+inline unsigned char luma(const unsigned char* px, int channels) {
+    if (channels < 3) return px[0];
+    return (unsigned char)((77 * px[0] + 151 * px[1] + 28 * px[2]) >> 8);
+}
+
+// Downsamples to w x h first, then converts the small result to gray
+std::vector<unsigned char> grayThumbnail(const unsigned char* src, int sw, int sh, int channels,
+                                         int w, int h) {
+    std::vector<unsigned char> small(size_t(w) * h * channels);
+    boxResample(src, sw, sh, channels, small.data(), w, h);
+    std::vector<unsigned char> gray(size_t(w) * h);
+    for (size_t i = 0; i < gray.size(); ++i) gray[i] = luma(&small[i * channels], channels);
+    return gray;
+}
+
+bool readFile(const std::string& path, std::vector<unsigned char>& bytes) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    std::streamoff size = file.tellg();
+    if (size <= 0) return false;
+    bytes.resize(size_t(size));
+    file.seekg(0);
+    return bool(file.read(reinterpret_cast<char*>(bytes.data()), size));
+}
+
+// xxHash64
+const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+inline uint64_t read64(const unsigned char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; }
+inline uint32_t read32(const unsigned char* p) { uint32_t v; std::memcpy(&v, p, 4); return v; }
+inline uint64_t xxRound(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * kPrime2, 31) * kPrime1;
+}
+inline uint64_t xxMerge(uint64_t acc, uint64_t val) {
+    return (acc ^ xxRound(0, val)) * kPrime1 + kPrime4;
+}
+
+uint64_t xxHash64(const unsigned char* p, size_t len, uint64_t seed = 0) {
+    const unsigned char* end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + kPrime1 + kPrime2, v2 = seed + kPrime2, v3 = seed, v4 = seed - kPrime1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxRound(v1, read64(p));
+            v2 = xxRound(v2, read64(p + 8));
+            v3 = xxRound(v3, read64(p + 16));
+            v4 = xxRound(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxMerge(xxMerge(xxMerge(xxMerge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + kPrime5;
     }
-    updatePixelData(partialPixels.data(), w, h, channels);
-    stbi_image_free(data);
-    return true;
+    h += uint64_t(len);
+    for (; p + 8 <= end; p += 8) h = rotl64(h ^ xxRound(0, read64(p)), 27) * kPrime1 + kPrime4;
+    if (p + 4 <= end) {
+        h = rotl64(h ^ (uint64_t(read32(p)) * kPrime1), 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = rotl64(h ^ (*p * kPrime5), 11) * kPrime1;
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
 }
 
-int Image::width() const { return m_width; }
-int Image::height() const { return m_height; }
-const unsigned char* Image::data() const { return m_pixels.data(); }
-bool Image::hasAlpha() const { return m_channels == 4; }
+// .yiv container header; pixel data follows at dataOffset
+struct RawHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    int32_t tileSize;
+    uint64_t stride;     // bytes per image row, or per tile row when tiled
+    uint64_t dataOffset;
+    uint8_t reserved[24];
+};
+static_assert(sizeof(RawHeader) == 64, "RawHeader must stay 64 bytes");
+const char kRawMagic[4] = {'Y', 'I', 'V', 'R'};
 
-void Image::updatePixelData(const unsigned char* data, int width, int height, int channels) {
-    m_width = width;
-    m_height = height;
-    m_channels = channels;
-    m_pixels.assign(data, data + width * height * channels);
+// Bounds keep every width + tileSize and tile-offset product inside int
+const int kRawMaxTileSize = 1 << 16;
+const int kRawMaxDimension = INT_MAX - kRawMaxTileSize;
+
+// Validates a header against the number of bytes actually available
+const RawHeader* rawHeader(const unsigned char* bytes, size_t size) {
+    if (size < sizeof(RawHeader)) return nullptr;
+    const RawHeader* h = reinterpret_cast<const RawHeader*>(bytes);
+    if (std::memcmp(h->magic, kRawMagic, 4) != 0 || h->version != 1) return nullptr;
+    if (h->width <= 0 || h->height <= 0 || h->width > kRawMaxDimension || h->height > kRawMaxDimension ||
+        h->channels <= 0 || h->channels > 4 || h->tileSize < 0 || h->tileSize > kRawMaxTileSize)
+        return nullptr;
+    size_t minStride = size_t(h->tileSize > 0 ? h->tileSize : h->width) * h->channels;
+    if (h->stride < minStride || h->dataOffset < sizeof(RawHeader) || h->dataOffset > size) return nullptr;
+
+    // Rows of `stride` bytes the data needs, compared by division so no product can overflow
+    uint64_t rows = (size - h->dataOffset) / h->stride;
+    if (h->tileSize == 0) return uint64_t(h->height) <= rows ? h : nullptr;
+    uint64_t tilesX = (h->width + h->tileSize - 1) / h->tileSize;
+    uint64_t tileRows = uint64_t((h->height + h->tileSize - 1) / h->tileSize) * h->tileSize;
+    return tilesX <= rows / tileRows ? h : nullptr;
 }
 
-void Image::rotateClockwise() {
-    std::vector<unsigned char> rotated(m_pixels.size());
-    for (int y = 0; y < m_height; ++y) {
-        for (int x = 0; x < m_width; ++x) {
-            for (int c = 0; c < m_channels; ++c) {
-                rotated[(x * m_height + (m_height - y - 1)) * m_channels + c] =
-                    m_pixels[(y * m_width + x) * m_channels + c];
+// QOI ("Quite OK Image") lossless codec: one pass, no entropy coder
+const unsigned char kQoiOpIndex = 0x00, kQoiOpDiff = 0x40, kQoiOpLuma = 0x80, kQoiOpRun = 0xc0;
+const unsigned char kQoiOpRgb = 0xfe, kQoiOpRgba = 0xff;
+const unsigned char kQoiPadding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+struct QoiPixel { unsigned char r, g, b, a; };
+inline bool operator==(QoiPixel a, QoiPixel b) { return std::memcmp(&a, &b, 4) == 0; }
+inline int qoiHash(QoiPixel p) { return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64; }
+
+inline void writeBE32(unsigned char* p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+inline uint32_t readBE32(const unsigned char* p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+// 1- and 2-channel input is written as RGB / RGBA, the closest QOI layouts
+bool qoiEncode(const unsigned char* px, int width, int height, int channels, std::vector<unsigned char>& out) {
+    if (!px || width <= 0 || height <= 0 || channels < 1 || channels > 4) return false;
+    bool alpha = channels == 2 || channels == 4;
+    size_t count = size_t(width) * height;
+    // Typical output is well under the raw size; growth past the estimate is amortized
+    out.clear();
+    out.reserve(14 + count * (alpha ? 4 : 3) / 2 + sizeof(kQoiPadding));
+    out.resize(14);
+    unsigned char* o = out.data();
+    std::memcpy(o, "qoif", 4);
+    writeBE32(o + 4, uint32_t(width));
+    writeBE32(o + 8, uint32_t(height));
+    o[12] = alpha ? 4 : 3;
+    o[13] = 0; // sRGB with linear alpha
+
+    QoiPixel index[64] = {};
+    QoiPixel prev = {0, 0, 0, 255};
+    int run = 0;
+    for (size_t i = 0; i < count; ++i, px += channels) {
+        QoiPixel cur;
+        if (channels >= 3) {
+            cur = {px[0], px[1], px[2], channels == 4 ? px[3] : (unsigned char)255};
+        } else {
+            cur = {px[0], px[0], px[0], channels == 2 ? px[1] : (unsigned char)255};
+        }
+        if (cur == prev) {
+            if (++run == 62 || i + 1 == count) {
+                out.push_back(kQoiOpRun | (run - 1));
+                run = 0;
             }
+            continue;
         }
+        if (run > 0) {
+            out.push_back(kQoiOpRun | (run - 1));
+            run = 0;
+        }
+        int h = qoiHash(cur);
+        if (index[h] == cur) {
+            out.push_back(kQoiOpIndex | h);
+        } else {
+            index[h] = cur;
+            if (cur.a == prev.a) {
+                signed char vr = cur.r - prev.r, vg = cur.g - prev.g, vb = cur.b - prev.b;
+                signed char vgr = vr - vg, vgb = vb - vg;
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    out.push_back(kQoiOpDiff | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                } else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+                    out.push_back(kQoiOpLuma | (vg + 32));
+                    out.push_back((vgr + 8) << 4 | (vgb + 8));
+                } else {
+                    const unsigned char op[4] = {kQoiOpRgb, cur.r, cur.g, cur.b};
+                    out.insert(out.end(), op, op + 4);
+                }
+            } else {
+                const unsigned char op[5] = {kQoiOpRgba, cur.r, cur.g, cur.b, cur.a};
+                out.insert(out.end(), op, op + 5);
+            }
+        }
+        prev = cur;
     }
-    std::swap(m_width, m_height);
-    m_pixels = std::move(rotated);
+    out.insert(out.end(), kQoiPadding, kQoiPadding + sizeof(kQoiPadding));
+    return true;
 }
 
-void Image::rotateCounterClockwise() {
-    rotateClockwise();
-    rotateClockwise();
-    rotateClockwise();
+bool qoiDecode(const unsigned char* bytes, size_t size, std::vector<unsigned char>& out,
+               int& width, int& height, int& channels) {
+    if (size < 14 + sizeof(kQoiPadding) || std::memcmp(bytes, "qoif", 4) != 0) return false;
+    uint32_t w = readBE32(bytes + 4), h = readBE32(bytes + 8);
+    channels = bytes[12];
+    // Every op byte yields at most 62 pixels, so a short stream cannot claim a huge image
+    uint64_t maxPixels = uint64_t(size - 14 - sizeof(kQoiPadding)) * 62;
+    if (w == 0 || h == 0 || (channels != 3 && channels != 4) || uint64_t(w) * h > (uint64_t(1) << 31) ||
+        uint64_t(w) * h > maxPixels)
+        return false;
+    width = int(w);
+    height = int(h);
+
+    size_t count = size_t(w) * h;
+    out.resize(count * channels);
+    unsigned char* o = out.data();
+    const unsigned char* p = bytes + 14;
+    const unsigned char* end = bytes + size - sizeof(kQoiPadding);
+    QoiPixel index[64] = {};
+    QoiPixel px = {0, 0, 0, 255};
+    int run = 0;
+    for (size_t i = 0; i < count; ++i, o += channels) {
+        if (run > 0) {
+            --run;
+        } else if (p < end) {
+            unsigned char b1 = *p++;
+            if (b1 == kQoiOpRgb) {
+                if (end - p < 3) return false;
+                px.r = p[0]; px.g = p[1]; px.b = p[2];
+                p += 3;
+            } else if (b1 == kQoiOpRgba) {
+                if (end - p < 4) return false;
+                px.r = p[0]; px.g = p[1]; px.b = p[2]; px.a = p[3];
+                p += 4;
+            } else if ((b1 & 0xc0) == kQoiOpIndex) {
+                px = index[b1];
+            } else if ((b1 & 0xc0) == kQoiOpDiff) {
+                px.r += ((b1 >> 4) & 3) - 2;
+                px.g += ((b1 >> 2) & 3) - 2;
+                px.b += (b1 & 3) - 2;
+            } else if ((b1 & 0xc0) == kQoiOpLuma) {
+                if (p >= end) return false;
+                unsigned char b2 = *p++;
+                int vg = (b1 & 0x3f) - 32;
+                px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                px.g += vg;
+                px.b += vg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+            index[qoiHash(px)] = px;
+        } else {
+            return false; // truncated stream
+        }
+        o[0] = px.r; o[1] = px.g; o[2] = px.b;
+        if (channels == 4) o[3] = px.a;
+    }
+    return true;
 }
 
-void Image::scale(float factor) {
-    if (factor <= 0) return;
-    int newW = int(m_width * factor);
-    int newH = int(m_height * factor);
-    std::vector<unsigned char> newPixels(newW * newH * m_channels);
+void appendToVector(void* context, void* data, int size) {
+    auto* out = static_cast<std::vector<unsigned char>*>(context);
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    out->insert(out->end(), bytes, bytes + size);
+}
 
-    for (int y = 0; y < newH; ++y) {
-        for (int x = 0; x < newW; ++x) {
-            int srcX = int(x / factor);
-            int srcY = int(y / factor);
-            for (int c = 0; c < m_channels; ++c) {
-                newPixels[(y * newW + x) * m_channels + c] =
-                    m_pixels[(srcY * m_width + srcX) * m_channels + c];
-            }
+// Channel scans work in blocks: a branch-free inner loop the compiler can
+// vectorise, with an early exit between blocks
+const size_t kScanBlock = 4096;
+
+bool alphaOpaque(const unsigned char* px, size_t count, int channels) {
+    const unsigned char* alpha = px + channels - 1;
+    for (size_t begin = 0; begin < count; begin += kScanBlock) {
+        size_t end = std::min(count, begin + kScanBlock);
+        unsigned char acc = 255;
+        for (size_t i = begin; i < end; ++i) acc &= alpha[i * channels];
+        if (acc != 255) return false;
+    }
+    return true;
+}
+
+bool colorsGray(const unsigned char* px, size_t count, int channels) {
+    for (size_t begin = 0; begin < count; begin += kScanBlock) {
+        size_t end = std::min(count, begin + kScanBlock);
+        unsigned char diff = 0;
+        for (size_t i = begin; i < end; ++i) {
+            const unsigned char* p = px + i * channels;
+            diff |= (p[0] ^ p[1]) | (p[0] ^ p[2]);
         }
+        if (diff) return false;
     }
-    m_pixels = std::move(newPixels);
-    m_width = newW;
-    m_height = newH;
+    return true;
 }
 
-// Filters (basic)
-void Image::applyFilter(FilterType type) {
+// Backs Image::compactChannels; returns the new channel count
+int compactPixels(std::vector<unsigned char>& pixels, size_t count, int channels) {
+    if (count == 0) return channels;
+    bool dropAlpha = (channels == 2 || channels == 4) && alphaOpaque(pixels.data(), count, channels);
+    bool gray = channels >= 3 && colorsGray(pixels.data(), count, channels);
+    if (!dropAlpha && !gray) return channels;
+
+    int keepColor = gray ? 1 : (channels >= 3 ? 3 : 1);
+    bool keepAlpha = (channels == 2 || channels == 4) && !dropAlpha;
+    int compacted = keepColor + (keepAlpha ? 1 : 0);
+    // Output stride never exceeds input stride, so compact towards the front in place
+    unsigned char* p = pixels.data();
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char* src = p + i * channels;
+        unsigned char* dst = p + i * compacted;
+        for (int c = 0; c < keepColor; ++c) dst[c] = src[c];
+        if (keepAlpha) dst[keepColor] = src[channels - 1];
+    }
+    pixels.resize(count * compacted);
+    pixels.shrink_to_fit();
+    return compacted;
+}
+
+// Backs Image::applyFilter; also used on palettes
+void filterPixels(std::vector<unsigned char>& pixels, int channels, FilterType type) {
     switch(type) {
         case FilterType::Grayscale:
-            for (int i = 0; i < m_width*m_height*m_channels; i+=m_channels) {
+            if (channels < 3) break; // already gray
+            for (size_t i = 0; i < pixels.size(); i+=channels) {
                 unsigned char gray = static_cast<unsigned char>(
-                    0.3*m_pixels[i] + 0.59*m_pixels[i+1] + 0.11*m_pixels[i+2]);
-                m_pixels[i] = m_pixels[i+1] = m_pixels[i+2] = gray;
+                    0.3*pixels[i] + 0.59*pixels[i+1] + 0.11*pixels[i+2]);
+                pixels[i] = pixels[i+1] = pixels[i+2] = gray;
             }
             break;
         case FilterType::Invert:
-            for (auto& px : m_pixels) px = 255 - px;
+            for (auto& px : pixels) px = 255 - px;
             break;
         case FilterType::Brightness:
-            for (auto& px : m_pixels) px = std::min(255, px + 50);
+            for (auto& px : pixels) px = std::min(255, px + 50);
             break;
         case FilterType::Contrast:
-            for (auto& px : m_pixels) px = std::min(255, std::max(0, int((px-128)*1.2 + 128)));
+            for (auto& px : pixels) px = std::min(255, std::max(0, int((px-128)*1.2 + 128)));
             break;
     }
 }
 
-bool Image::saveAs(const std::string& path, ImageFormat format) {
-    int success = 0;
-    switch(format) {
-        case ImageFormat::PNG:
-            success = stbi_write_png(path.c_str(), m_width, m_height, m_channels, m_pixels.data(), m_width*m_channels);
-            break;
-        case ImageFormat::JPEG:
-            success = stbi_write_jpg(path.c_str(), m_width, m_height, m_channels, m_pixels.data(), 90);
-            break;
-        case ImageFormat::BMP:
-            success = stbi_write_bmp(path.c_str(), m_width, m_height, m_channels, m_pixels.data());
-            break;
-        case ImageFormat::TGA:
-            success = stbi_write_tga(path.c_str(), m_width, m_height, m_channels, m_pixels.data());
-            break;
-        default:
-            return false;
+// CRC-32 as used by PNG chunks
+uint32_t crc32(const unsigned char* p, size_t len, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Transposes an 8x8 bit block held as 8 bytes, row 0 in the top byte (Hacker's Delight 7-3)
+inline uint64_t transpose8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;  x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x = x ^ t ^ (t << 28);
+    return x;
+}
+
+inline unsigned char reverseBits(unsigned char b) {
+    b = (unsigned char)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+    b = (unsigned char)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+    return (unsigned char)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+}
+
+inline int popcount8(unsigned char b) {
+    int n = 0;
+    for (; b; b &= b - 1) ++n;
+    return n;
+}
+
+// Copies `count` bits starting at bit `from` of src to the start of dst (MSB first)
+void copyBits(const unsigned char* src, size_t from, unsigned char* dst, size_t count) {
+    size_t bytes = (count + 7) / 8;
+    const unsigned char* s = src + from / 8;
+    int shift = int(from % 8);
+    size_t available = (from + count + 7) / 8 - from / 8; // source bytes that may be read
+    for (size_t i = 0; i < bytes; ++i) {
+        unsigned hi = s[i];
+        unsigned lo = i + 1 < available ? s[i + 1] : 0;
+        dst[i] = (unsigned char)(shift ? (hi << shift | lo >> (8 - shift)) : hi);
     }
-    return success != 0;
+    if (count % 8) dst[bytes - 1] &= (unsigned char)(0xFF << (8 - count % 8));
 }
 
-std::shared_ptr<Image> Image::generateThumbnail(int maxWidth, int maxHeight) {
-    float scaleFactor = std::min(float(maxWidth)/m_width, float(maxHeight)/m_height);
-    auto thumb = std::make_shared<Image>();
-    thumb->updatePixelData(m_pixels.data(), m_width, m_height, m_channels);
-    thumb->scale(scaleFactor);
-    return thumb;
+// PackBits run-length coding (TIFF compression 32773)
+void packBits(const unsigned char* p, size_t len, std::vector<unsigned char>& out) {
+    size_t i = 0;
+    while (i < len) {
+        size_t run = 1;
+        while (i + run < len && run < 128 && p[i + run] == p[i]) ++run;
+        if (run > 1) {
+            out.push_back((unsigned char)(257 - run));
+            out.push_back(p[i]);
+            i += run;
+            continue;
+        }
+        size_t lit = 1;
+        while (i + lit < len && lit < 128 && !(i + lit + 1 < len && p[i + lit] == p[i + lit + 1])) ++lit;
+        out.push_back((unsigned char)(lit - 1));
+        out.insert(out.end(), p + i, p + i + lit);
+        i += lit;
+    }
 }
 
-std::string Image::getMetadata(const std::string& key) const {
-    // TODO: Implement EXIF parsing if needed
-    return "";
+std::vector<unsigned char> grayPlane(const unsigned char* px, int width, int height, int channels) {
+    std::vector<unsigned char> gray(size_t(width) * height);
+    parallelFor(height, [&](int begin, int end) {
+        for (size_t i = size_t(begin) * width; i < size_t(end) * width; ++i)
+            gray[i] = luma(px + i * channels, channels);
+    });
+    return gray;
 }
 
-// ==================== IMAGELIST ====================
-void ImageList::add(std::shared_ptr<Image> img) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    m_images.push_back(img);
+// Four interleaved sub-histograms avoid stalls on runs of equal values
+void histogram256(const unsigned char* p, size_t count, uint64_t hist[256]) {
+    uint32_t sub[4][256] = {};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        ++sub[0][p[i]];
+        ++sub[1][p[i + 1]];
+        ++sub[2][p[i + 2]];
+        ++sub[3][p[i + 3]];
+    }
+    for (; i < count; ++i) ++sub[0][p[i]];
+    for (int v = 0; v < 256; ++v) hist[v] += uint64_t(sub[0][v]) + sub[1][v] + sub[2][v] + sub[3][v];
 }
 
-void ImageList::remove(size_t index) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (index >= m_images.size()) return;
-    m_images.erase(m_images.begin() + index);
+// Histogram of a gray plane, one band per thread; bands stay below 2^32 pixels
+void grayHistogram(const unsigned char* gray, int width, int height, uint64_t hist[256]) {
+    std::fill(hist, hist + 256, 0);
+    std::mutex merge;
+    parallelFor(height, [&](int begin, int end) {
+        uint64_t local[256] = {};
+        for (int y = begin; y < end; y += 4096)
+            histogram256(gray + size_t(y) * width, size_t(std::min(end - y, 4096)) * width, local);
+        std::lock_guard<std::mutex> lock(merge);
+        for (int v = 0; v < 256; ++v) hist[v] += local[v];
+    });
 }
 
-std::shared_ptr<Image> ImageList::at(size_t index) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (index >= m_images.size()) return nullptr;
-    return m_images[index];
+// Threshold maximising between-class variance; pixels above it are white
+int otsuFromHistogram(const uint64_t hist[256]) {
+    double total = 0, sum = 0;
+    for (int v = 0; v < 256; ++v) {
+        total += double(hist[v]);
+        sum += double(v) * hist[v];
+    }
+    double sumBelow = 0, weightBelow = 0, best = -1;
+    int threshold = 0;
+    for (int t = 0; t < 256; ++t) {
+        weightBelow += double(hist[t]);
+        if (weightBelow == 0) continue;
+        double weightAbove = total - weightBelow;
+        if (weightAbove == 0) break;
+        sumBelow += double(t) * hist[t];
+        double meanBelow = sumBelow / weightBelow;
+        double meanAbove = (sum - sumBelow) / weightAbove;
+        double between = weightBelow * weightAbove * (meanBelow - meanAbove) * (meanBelow - meanAbove);
+        if (between > best) {
+            best = between;
+            threshold = t;
+        }
+    }
+    return threshold;
 }
 
-size_t ImageList::count() const {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    return m_images.size();
+// Calls emit(y, mask) for every row with mask[x] = 1 for white pixels.
+// Rows come from parallel bands. Adaptive methods keep per-column sums of
+// the vertical window plus a row prefix sum (a rolling integral image), so
+// cost per pixel does not depend on the window size.
+template <typename Emit>
+void thresholdRows(const unsigned char* gray, int width, int height, ThresholdMethod method,
+                   int window, float k, Emit emit) {
+    if (method == ThresholdMethod::Otsu) {
+        uint64_t hist[256];
+        grayHistogram(gray, width, height, hist);
+        int t = otsuFromHistogram(hist);
+        parallelFor(height, [&](int begin, int end) {
+            std::vector<unsigned char> mask(width);
+            for (int y = begin; y < end; ++y) {
+                const unsigned char* row = gray + size_t(y) * width;
+                for (int x = 0; x < width; ++x) mask[x] = row[x] > t;
+                emit(y, mask.data());
+            }
+        });
+        return;
+    }
+
+    int r = std::max(1, window / 2);
+    bool sauvola = method == ThresholdMethod::Sauvola;
+    parallelFor(height, [&](int begin, int end) {
+        std::vector<uint32_t> colSum(width, 0);
+        std::vector<uint64_t> colSq(sauvola ? width : 0, 0);
+        std::vector<uint64_t> prefix(width + 1), prefixSq(sauvola ? width + 1 : 0);
+        std::vector<unsigned char> mask(width);
+        auto addRow = [&](int y, int sign) {
+            const unsigned char* row = gray + size_t(y) * width;
+            for (int x = 0; x < width; ++x) {
+                colSum[x] += uint32_t(sign * row[x]);
+                if (sauvola) colSq[x] += uint64_t(int64_t(sign) * row[x] * row[x]);
+            }
+        };
+        for (int y = std::max(0, begin - r); y <= std::min(height - 1, begin + r); ++y) addRow(y, 1);
+
+        for (int y = begin; y < end; ++y) {
+            int rows = std::min(height - 1, y + r) - std::max(0, y - r) + 1;
+            prefix[0] = 0;
+            for (int x = 0; x < width; ++x) prefix[x + 1] = prefix[x] + colSum[x];
+            if (sauvola) {
+                prefixSq[0] = 0;
+                for (int x = 0; x < width; ++x) prefixSq[x + 1] = prefixSq[x] + colSq[x];
+            }
+            const unsigned char* row = gray + size_t(y) * width;
+            for (int x = 0; x < width; ++x) {
+                int x0 = std::max(0, x - r), x1 = std::min(width, x + r + 1);
+                double n = double(rows) * (x1 - x0);
+                double mean = double(prefix[x1] - prefix[x0]) / n;
+                double t;
+                if (sauvola) {
+                    double var = double(prefixSq[x1] - prefixSq[x0]) / n - mean * mean;
+                    t = mean * (1.0 + k * (std::sqrt(std::max(0.0, var)) / 128.0 - 1.0));
+                } else {
+                    t = mean * (1.0 - k);
+                }
+                mask[x] = row[x] > t;
+            }
+            emit(y, mask.data());
+            if (y + 1 < end) {
+                if (y + r + 1 < height) addRow(y + r + 1, 1);
+                if (y - r >= 0) addRow(y - r, -1);
+            }
+        }
+    });
 }
 
-void ImageList::shuffle() {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    std::random_device rd;
-    std::mt19937 g(rd());
-    std::shuffle(m_images.begin(), m_images.end(), g);
+// van Herk / Gil-Werman running min/max: the padded line is split into
+// blocks of k, with prefix (g) and suffix (h) extrema inside each block, so
+// every window is op(h[start], g[end]) -- three ops per element for any k.
+// The window for output i covers inputs [i - k/2, i - k/2 + k - 1].
+
+// Vertical pass over rows of rowLen elements (T = byte or packed word).
+// identity is the neutral element of op (0 for max and or, all ones for min and and).
+template <typename T, typename Op>
+void vanHerkColumns(T* data, size_t rowLen, int height, int k, T identity, Op op) {
+    if (k <= 1 || height == 0 || rowLen == 0) return;
+    int top = k / 2;
+    size_t strip = std::min<size_t>(512, rowLen);
+    int strips = int((rowLen + strip - 1) / strip);
+    // Narrow inputs have too few strips for every thread, so they are split
+    // into row bands as well. A band reads k - 1 rows beyond its own, so
+    // banded results are staged and copied back once all bands are done.
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    int bands = std::min(std::max(1, threads / strips), std::max(1, height / std::max(k, 64)));
+    int bandRows = (height + bands - 1) / bands;
+    bands = (height + bandRows - 1) / bandRows;
+    std::vector<T> staged(bands > 1 ? rowLen * height : 0);
+    T* out = bands > 1 ? staged.data() : data;
+
+    parallelFor(strips * bands, [&](int begin, int end) {
+        std::vector<T> g(size_t(bandRows + k - 1) * strip), h(g.size()), pad(strip, identity);
+        for (int task = begin; task < end; ++task) {
+            size_t x0 = size_t(task % strips) * strip;
+            size_t n = std::min(strip, rowLen - x0);
+            int y0 = task / strips * bandRows, y1 = std::min(height, y0 + bandRows);
+            // Padded rows [p0, p1) cover every block the band's windows touch;
+            // blocks stay aligned to multiples of k in padded coordinates
+            int p0 = y0, p1 = y1 + k - 1;
+            auto source = [&](int p) {
+                int y = p - top;
+                return y >= 0 && y < height ? data + size_t(y) * rowLen + x0 : pad.data();
+            };
+            for (int p = p0; p < p1; ++p) {
+                T* gp = &g[size_t(p - p0) * strip];
+                const T* src = source(p);
+                if (p % k == 0 || p == p0) {
+                    std::copy(src, src + n, gp);
+                } else {
+                    for (size_t x = 0; x < n; ++x) gp[x] = op(gp[x - strip], src[x]);
+                }
+            }
+            for (int p = p1 - 1; p >= p0; --p) {
+                T* hp = &h[size_t(p - p0) * strip];
+                const T* src = source(p);
+                if (p % k == k - 1 || p == p1 - 1) {
+                    std::copy(src, src + n, hp);
+                } else {
+                    for (size_t x = 0; x < n; ++x) hp[x] = op(hp[x + strip], src[x]);
+                }
+            }
+            for (int y = y0; y < y1; ++y) {
+                const T* hp = &h[size_t(y - p0) * strip];
+                const T* gp = &g[size_t(y - p0 + k - 1) * strip];
+                T* dst = &out[size_t(y) * rowLen + x0];
+                for (size_t x = 0; x < n; ++x) dst[x] = op(hp[x], gp[x]);
+            }
+        }
+    });
+    if (bands > 1)
+        parallelFor(height, [&](int begin, int end) {
+            std::copy(&staged[size_t(begin) * rowLen], &staged[0] + size_t(end) * rowLen, data + size_t(begin) * rowLen);
+        });
 }
 
-void ImageList::sort(bool (*comparator)(std::shared_ptr<Image>, std::shared_ptr<Image>)) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    std::sort(m_images.begin(), m_images.end(), comparator);
+// Horizontal pass over interleaved 8-bit pixels
+template <typename Op>
+void vanHerkRows(unsigned char* data, int width, int height, int channels, int k,
+                 unsigned char identity, Op op) {
+    if (k <= 1 || width == 0) return;
+    int left = k / 2;
+    int padded = width + k - 1;
+    parallelFor(height, [&](int begin, int end) {
+        std::vector<unsigned char> line(size_t(padded) * channels, identity);
+        std::vector<unsigned char> g(line.size()), h(line.size());
+        for (int y = begin; y < end; ++y) {
+            unsigned char* row = data + size_t(y) * width * channels;
+            std::memcpy(&line[size_t(left) * channels], row, size_t(width) * channels);
+            for (int p = 0; p < padded; ++p)
+                for (int c = 0; c < channels; ++c) {
+                    size_t i = size_t(p) * channels + c;
+                    g[i] = p % k == 0 ? line[i] : op(g[i - channels], line[i]);
+                }
+            for (int p = padded - 1; p >= 0; --p)
+                for (int c = 0; c < channels; ++c) {
+                    size_t i = size_t(p) * channels + c;
+                    h[i] = (p % k == k - 1 || p == padded - 1) ? line[i] : op(h[i + channels], line[i]);
+                }
+            for (int x = 0; x < width; ++x)
+                for (int c = 0; c < channels; ++c)
+                    row[size_t(x) * channels + c] = op(h[size_t(x) * channels + c], g[size_t(x + k - 1) * channels + c]);
+        }
+    });
 }
 
-void ImageList::lock() { m_mutex.lock(); }
-void ImageList::unlock() { m_mutex.unlock(); }
+// Packed rows as MSB-first 64-bit words: bit x is (w[x >> 6] >> (63 - (x & 63))) & 1
+inline uint64_t loadWordBE(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = v << 8 | p[i];
+    return v;
+}
+inline void storeWordBE(unsigned char* p, uint64_t v) {
+    for (int i = 7; i >= 0; --i, v >>= 8) p[i] = (unsigned char)v;
+}
+
+// out[x] = in[x + s] (s >= 0) or in[x - |s|] (s < 0); vacated bits take `fill`
+void shiftBits(const uint64_t* in, uint64_t* out, int words, int s, uint64_t fill) {
+    int q = std::abs(s) / 64, r = std::abs(s) % 64;
+    auto at = [&](int i) { return i >= 0 && i < words ? in[i] : fill; };
+    for (int i = 0; i < words; ++i) {
+        if (s >= 0) out[i] = r ? (at(i + q) << r | at(i + q + 1) >> (64 - r)) : at(i + q);
+        else out[i] = r ? (at(i - q) >> r | at(i - q - 1) << (64 - r)) : at(i - q);
+    }
+}
+
+// Two-pass union-find labelling. labels[i] - 1 is a parent pixel index and
+// parents always precede children in raster order, so one sequential pass
+// can both flatten the forest and renumber roots consecutively.
+template <typename Foreground>
+int labelPixels(int width, int height, bool eightConnected, Foreground fg,
+                std::vector<uint32_t>& labels, std::vector<ComponentStats>& stats) {
+    labels.assign(size_t(width) * height, 0);
+    stats.clear();
+    if (labels.empty()) return 0;
+    auto find = [&](size_t i) {
+        while (labels[i] - 1 != i) {
+            size_t parent = labels[i] - 1;
+            labels[i] = labels[parent]; // path halving keeps parents earlier
+            i = parent;
+        }
+        return i;
+    };
+    auto unite = [&](size_t a, size_t b) {
+        a = find(a);
+        b = find(b);
+        if (a < b) labels[b] = uint32_t(a + 1);
+        else if (b < a) labels[a] = uint32_t(b + 1);
+    };
+    auto scanRow = [&](int y, int firstRow) {
+        for (int x = 0; x < width; ++x) {
+            if (!fg(x, y)) continue;
+            size_t i = size_t(y) * width + x;
+            labels[i] = uint32_t(i + 1);
+            if (x > 0 && labels[i - 1]) unite(i - 1, i);
+            if (y > firstRow) {
+                size_t up = i - width;
+                if (labels[up]) unite(up, i);
+                if (eightConnected) {
+                    if (x > 0 && labels[up - 1]) unite(up - 1, i);
+                    if (x + 1 < width && labels[up + 1]) unite(up + 1, i);
+                }
+            }
+        }
+    };
+
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    int bandHeight = std::max(32, (height + threads - 1) / threads);
+    int bands = (height + bandHeight - 1) / bandHeight;
+    parallelFor(bands, [&](int begin, int end) {
+        for (int band = begin; band < end; ++band) {
+            int y0 = band * bandHeight, y1 = std::min(height, y0 + bandHeight);
+            for (int y = y0; y < y1; ++y) scanRow(y, y0);
+        }
+    });
+    // Stitch each band's first row to the row above it
+    for (int band = 1; band < bands; ++band) {
+        int y = band * bandHeight;
+        for (int x = 0; x < width; ++x) {
+            size_t i = size_t(y) * width + x;
+            if (!labels[i]) continue;
+            size_t up = i - width;
+            if (labels[up]) unite(up, i);
+            if (eightConnected) {
+                if (x > 0 && labels[up - 1]) unite(up - 1, i);
+                if (x + 1 < width && labels[up + 1]) unite(up + 1, i);
+            }
+        }
+    }
+
+    std::vector<double> sumX, sumY;
+    for (size_t i = 0; i < labels.size(); ++i) {
+        if (!labels[i]) continue;
+        size_t parent = labels[i] - 1;
+        uint32_t label;
+        if (parent == i) {
+            stats.emplace_back();
+            sumX.push_back(0);
+            sumY.push_back(0);
+            label = uint32_t(stats.size());
+            int x = int(i % width), y = int(i / width);
+            stats.back().bounds = Rect{x, y, 1, 1};
+        } else {
+            label = labels[parent]; // already final
+        }
+        labels[i] = label;
+        ComponentStats& st = stats[label - 1];
+        int x = int(i % width), y = int(i / width);
+        Rect& b = st.bounds;
+        if (x < b.x) { b.width += b.x - x; b.x = x; }
+        if (x >= b.x + b.width) b.width = x - b.x + 1;
+        if (y >= b.y + b.height) b.height = y - b.y + 1;
+        ++st.area;
+        sumX[label - 1] += x;
+        sumY[label - 1] += y;
+    }
+    for (size_t l = 0; l < stats.size(); ++l) {
+        stats[l].centroidX = sumX[l] / stats[l].area;
+        stats[l].centroidY = sumY[l] / stats[l].area;
+    }
+    return int(stats.size());
+}
+
+// Filter taps for one resampling axis: box (area) weights when shrinking,
+// linear interpolation when enlarging. Never reads outside [start, start + length).
+struct AxisTaps {
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<float> weights; // count[i] entries per output, packed
+    std::vector<size_t> offset;
+};
+
+AxisTaps axisTaps(int start, int length, int outLength) {
+    AxisTaps taps;
+    taps.first.resize(outLength);
+    taps.count.resize(outLength);
+    taps.offset.resize(outLength);
+    double scale = double(length) / outLength;
+    for (int i = 0; i < outLength; ++i) {
+        taps.offset[i] = taps.weights.size();
+        if (scale > 1.0) {
+            double a = i * scale, b = (i + 1) * scale;
+            int first = int(a), last = std::min(length - 1, int(std::ceil(b)) - 1);
+            taps.first[i] = start + first;
+            taps.count[i] = last - first + 1;
+            for (int s = first; s <= last; ++s) {
+                double overlap = std::min(b, double(s + 1)) - std::max(a, double(s));
+                taps.weights.push_back(float(overlap / scale));
+            }
+        } else {
+            double center = (i + 0.5) * scale - 0.5;
+            int s0 = int(std::floor(center));
+            float frac = float(center - s0);
+            int a = std::min(length - 1, std::max(0, s0)), b = std::min(length - 1, std::max(0, s0 + 1));
+            taps.first[i] = start + a;
+            taps.count[i] = b - a + 1;
+            if (a == b) {
+                taps.weights.push_back(1.0f);
+            } else {
+                taps.weights.push_back(1.0f - frac);
+                taps.weights.push_back(frac);
+            }
+        }
+    }
+    return taps;
+}
+
+// Fused crop + resize: resamples only `region` of src into dw x dh with
+// independent x/y factors. The intermediate buffer is region height x dw.
+void resampleRegion(const unsigned char* src, int sw, int channels, const Rect& region,
+                    unsigned char* dst, int dw, int dh) {
+    AxisTaps tx = axisTaps(region.x, region.width, dw);
+    AxisTaps ty = axisTaps(region.y, region.height, dh);
+    std::vector<float> rows(size_t(region.height) * dw * channels);
+    parallelFor(region.height, [&](int begin, int end) {
+        for (int ry = begin; ry < end; ++ry) {
+            const unsigned char* in = src + size_t(region.y + ry) * sw * channels;
+            float* out = &rows[size_t(ry) * dw * channels];
+            for (int x = 0; x < dw; ++x) {
+                float acc[4] = {0, 0, 0, 0};
+                const float* wt = &tx.weights[tx.offset[x]];
+                const unsigned char* p = in + size_t(tx.first[x]) * channels;
+                for (int k = 0; k < tx.count[x]; ++k, p += channels)
+                    for (int c = 0; c < channels; ++c) acc[c] += wt[k] * p[c];
+                for (int c = 0; c < channels; ++c) out[x * channels + c] = acc[c];
+            }
+        }
+    });
+    parallelFor(dh, [&](int begin, int end) {
+        std::vector<float> acc(size_t(dw) * channels);
+        for (int y = begin; y < end; ++y) {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            const float* wt = &ty.weights[ty.offset[y]];
+            for (int k = 0; k < ty.count[y]; ++k) {
+                const float* row = &rows[size_t(ty.first[y] - region.y + k) * dw * channels];
+                for (size_t i = 0; i < acc.size(); ++i) acc[i] += wt[k] * row[i];
+            }
+            unsigned char* out = dst + size_t(y) * dw * channels;
+            for (size_t i = 0; i < acc.size(); ++i)
+                out[i] = (unsigned char)std::min(255.0f, std::max(0.0f, acc[i] + 0.5f));
+        }
+    });
+}
+
+// Source region and output size for resizing sw x sh into a w x h box
+void fitRegion(FitMode mode, int sw, int sh, int w, int h, Rect& region, int& outW, int& outH) {
+    region = Rect{0, 0, sw, sh};
+    outW = w;
+    outH = h;
+    if (mode == FitMode::Fit) {
+        double f = std::min(double(w) / sw, double(h) / sh);
+        outW = std::max(1, int(sw * f + 0.5));
+        outH = std::max(1, int(sh * f + 0.5));
+    } else if (mode == FitMode::Cover) {
+        double aspect = double(w) / h;
+        if (double(sw) / sh > aspect) {
+            region.width = std::max(1, std::min(sw, int(sh * aspect + 0.5)));
+            region.x = (sw - region.width) / 2;
+        } else {
+            region.height = std::max(1, std::min(sh, int(sw / aspect + 0.5)));
+            region.y = (sh - region.height) / 2;
+        }
+    }
+}
+
+// ==================== PLACEHOLDERS ====================
+
+// RGB preview with the longest side at most maxSide. Each preview pixel
+// averages a 4x4 grid of samples from its source box, so the cost is fixed
+// by the preview size. palette is null unless src holds indices.
+std::vector<unsigned char> samplePreview(const unsigned char* src, int sw, int sh, int channels,
+                                         const unsigned char* palette, int maxSide, int& w, int& h) {
+    if (sw >= sh) {
+        w = std::min(sw, maxSide);
+        h = std::max(1, int(int64_t(sh) * w / sw));
+    } else {
+        h = std::min(sh, maxSide);
+        w = std::max(1, int(int64_t(sw) * h / sh));
+    }
+    std::vector<unsigned char> preview(size_t(w) * h * 3);
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            unsigned sum[3] = {0, 0, 0};
+            for (int j = 0; j < 4; ++j) {
+                int sy = int((int64_t(y) * 8 + 2 * j + 1) * sh / (int64_t(h) * 8));
+                for (int i = 0; i < 4; ++i) {
+                    int sx = int((int64_t(x) * 8 + 2 * i + 1) * sw / (int64_t(w) * 8));
+                    const unsigned char* px = palette ? palette + size_t(src[size_t(sy) * sw + sx]) * channels
+                                                      : src + (size_t(sy) * sw + sx) * channels;
+                    for (int c = 0; c < 3; ++c) sum[c] += px[channels < 3 ? 0 : c];
+                }
+            }
+            for (int c = 0; c < 3; ++c) preview[(size_t(y) * w + x) * 3 + c] = (unsigned char)((sum[c] + 8) / 16);
+        }
+    }
+    return preview;
+}
+
+// Colors by frequency on a 4-bit-per-channel histogram; a bin too close to
+// one already picked is skipped so the palette is not all shades of one color
+std::vector<Color> histogramColors(const std::vector<unsigned char>& rgb, int count) {
+    struct Bin {
+        unsigned n = 0, r = 0, g = 0, b = 0;
+    };
+    std::vector<Bin> bins(4096);
+    size_t pixels = rgb.size() / 3;
+    for (size_t i = 0; i < pixels; ++i) {
+        const unsigned char* px = &rgb[i * 3];
+        Bin& bin = bins[(px[0] >> 4) << 8 | (px[1] >> 4) << 4 | px[2] >> 4];
+        ++bin.n;
+        bin.r += px[0];
+        bin.g += px[1];
+        bin.b += px[2];
+    }
+    std::vector<int> order;
+    for (int i = 0; i < 4096; ++i)
+        if (bins[i].n) order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return bins[a].n > bins[b].n; });
+
+    std::vector<Color> colors;
+    for (int i : order) {
+        if (int(colors.size()) >= count) break;
+        const Bin& bin = bins[i];
+        Color color{(unsigned char)(bin.r / bin.n), (unsigned char)(bin.g / bin.n),
+                    (unsigned char)(bin.b / bin.n), float(bin.n) / float(pixels)};
+        bool distinct = true;
+        for (auto& c : colors) {
+            int dr = c.r - color.r, dg = c.g - color.g, db = c.b - color.b;
+            if (dr * dr + dg * dg + db * db < 48 * 48) {
+                c.weight += color.weight;
+                distinct = false;
+                break;
+            }
+        }
+        if (distinct) colors.push_back(color);
+    }
+    return colors;
+}
+
+float srgbToLinear(unsigned char v) {
+    static const auto table = [] {
+        std::vector<float> t(256);
+        for (int i = 0; i < 256; ++i) {
+            float f = i / 255.0f;
+            t[i] = f <= 0.04045f ? f / 12.92f : std::pow((f + 0.055f) / 1.055f, 2.4f);
+        }
+        return t;
+    }();
+    return table[v];
+}
+
+int linearToSrgb(float v) {
+    v = std::min(1.0f, std::max(0.0f, v));
+    if (v <= 0.0031308f) return int(v * 12.92f * 255 + 0.5f);
+    return int((1.055f * std::pow(v, 1 / 2.4f) - 0.055f) * 255 + 0.5f);
+}
+
+void appendBase83(std::string& out, int value, int length) {
+    static const char digits[] =
+        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+    int divisor = 1;
+    for (int i = 1; i < length; ++i) divisor *= 83;
+    for (; divisor > 0; divisor /= 83) out += digits[(value / divisor) % 83];
+}
+
+void appendBase64(std::string& out, const std::vector<unsigned char>& bytes) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i = 0;
+    for (; i + 2 < bytes.size(); i += 3) {
+        uint32_t v = uint32_t(bytes[i]) << 16 | uint32_t(bytes[i + 1]) << 8 | bytes[i + 2];
+        out += digits[v >> 18];
+        out += digits[(v >> 12) & 63];
+        out += digits[(v >> 6) & 63];
+        out += digits[v & 63];
+    }
+    if (i < bytes.size()) {
+        uint32_t v = uint32_t(bytes[i]) << 16 | (i + 1 < bytes.size() ? uint32_t(bytes[i + 1]) << 8 : 0);
+        out += digits[v >> 18];
+        out += digits[(v >> 12) & 63];
+        out += i + 1 < bytes.size() ? digits[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+}
+
+// ==================== DIFF ====================
+
+// Merges dirty tiles (row-major flags) into horizontal runs, clipped to the image
+std::vector<Rect> dirtyRuns(const std::vector<char>& dirty, int width, int height, int tileSize) {
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<Rect> rects;
+    for (int ty = 0; ty < tilesY; ++ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+            if (!dirty[size_t(ty) * tilesX + tx]) continue;
+            int end = tx + 1;
+            while (end < tilesX && dirty[size_t(ty) * tilesX + end]) ++end;
+            Rect r;
+            r.x = tx * tileSize;
+            r.y = ty * tileSize;
+            r.width = std::min(width, end * tileSize) - r.x;
+            r.height = std::min(height, (ty + 1) * tileSize) - r.y;
+            rects.push_back(r);
+            tx = end;
+        }
+    }
+    return rects;
+}
+
+// ==================== IN-PLACE TRANSFORMS ====================
+
+// Transposes width x height pixels in place by following the permutation's
+// cycles; `visited` costs one bit per pixel instead of a second buffer
+void transposeInPlace(unsigned char* px, int width, int height, int channels) {
+    size_t count = size_t(width) * height;
+    if (width == height) {
+        for (int y = 0; y < height; ++y)
+            for (int x = y + 1; x < width; ++x)
+                std::swap_ranges(px + (size_t(y) * width + x) * channels, px + (size_t(y) * width + x + 1) * channels,
+                                 px + (size_t(x) * width + y) * channels);
+        return;
+    }
+    // Position p of the transposed layout holds source pixel (p % height) * width + p / height
+    std::vector<uint64_t> visited((count + 63) / 64, 0);
+    unsigned char held[4];
+    for (size_t start = 1; start + 1 < count; ++start) {
+        if (visited[start >> 6] >> (start & 63) & 1) continue;
+        std::memcpy(held, px + start * channels, channels);
+        size_t p = start;
+        for (;;) {
+            visited[p >> 6] |= uint64_t(1) << (p & 63);
+            size_t q = (p % height) * width + p / height;
+            if (q == start) {
+                std::memcpy(px + p * channels, held, channels);
+                break;
+            }
+            std::memcpy(px + p * channels, px + q * channels, channels);
+            p = q;
+        }
+    }
+}
+
+void reverseRowPixels(unsigned char* row, int width, int channels) {
+    for (int a = 0, b = width - 1; a < b; ++a, --b)
+        std::swap_ranges(row + size_t(a) * channels, row + size_t(a + 1) * channels, row + size_t(b) * channels);
+}
+
+// count pixels read srcStep bytes apart and written dstStep bytes apart
+// (either may be negative); Channels is fixed so each pixel is a few moves
+template <int Channels>
+void copyPixelRun(const unsigned char* src, ptrdiff_t srcStep, unsigned char* dst, ptrdiff_t dstStep, int count) {
+    for (int i = 0; i < count; ++i, src += srcStep, dst += dstStep)
+        for (int c = 0; c < Channels; ++c) dst[c] = src[c];
+}
+
+using PixelRunFn = void (*)(const unsigned char*, ptrdiff_t, unsigned char*, ptrdiff_t, int);
+const PixelRunFn kPixelRuns[4] = {copyPixelRun<1>, copyPixelRun<2>, copyPixelRun<3>, copyPixelRun<4>};
+
+// ==================== VIEWPORT ====================
+
+struct BilinearTap {
+    int i0, i1; // source indices, i0 < 0 when the output pixel is outside the image
+    unsigned w1; // weight of i1, 0..256
+};
+
+// One output row over the visible columns [begin, end); Channels and
+// DstChannels are template parameters so the per-pixel work fully unrolls
+template <int Channels, int DstChannels>
+void bilinearRow(const unsigned char* r0, const unsigned char* r1, unsigned wy1, const BilinearTap* cols,
+                 int begin, int end, unsigned char* out) {
+    unsigned wy0 = 256 - wy1;
+    out += size_t(begin) * DstChannels;
+    for (int x = begin; x < end; ++x, out += DstChannels) {
+        const BilinearTap& t = cols[x];
+        unsigned wx1 = t.w1, wx0 = 256 - wx1;
+        const unsigned char* a = r0 + t.i0 * Channels;
+        const unsigned char* b = r0 + t.i1 * Channels;
+        const unsigned char* c = r1 + t.i0 * Channels;
+        const unsigned char* d = r1 + t.i1 * Channels;
+        unsigned char v[4];
+        for (int k = 0; k < Channels; ++k) {
+            unsigned top = a[k] * wx0 + b[k] * wx1, bottom = c[k] * wx0 + d[k] * wx1;
+            v[k] = (unsigned char)((top * wy0 + bottom * wy1 + 32768) >> 16);
+        }
+        // Gray sources are replicated; a missing alpha is opaque
+        out[0] = v[0];
+        out[1] = v[Channels < 3 ? 0 : 1];
+        out[2] = v[Channels < 3 ? 0 : 2];
+        if (DstChannels == 4) out[3] = Channels == 2 ? v[1] : Channels == 4 ? v[3] : 255;
+    }
+}
+
+// Bilinear sampling of src at zoomX/zoomY (output px per source px) with
+// (originX, originY) at the top-left output corner. Tap positions and 8-bit
+// weights are computed once per column and per row, the inner loop is
+// integer only, and columns outside the image are cleared in one memset.
+void renderBilinear(const unsigned char* src, int sw, int sh, int channels, double zoomX, double zoomY,
+                    double originX, double originY, unsigned char* dst, int dw, int dh, size_t dstStride,
+                    int dstChannels) {
+    auto taps = [](int count, double zoom, double origin, int size) {
+        std::vector<BilinearTap> t(count);
+        for (int i = 0; i < count; ++i) {
+            double s = (i + 0.5) / zoom + origin;
+            if (s < 0 || s >= size) {
+                t[i] = BilinearTap{-1, -1, 0};
+                continue;
+            }
+            double f = std::max(0.0, s - 0.5);
+            int i0 = std::min(size - 1, int(f));
+            t[i] = BilinearTap{i0, std::min(size - 1, i0 + 1), unsigned((f - i0) * 256 + 0.5)};
+        }
+        return t;
+    };
+    auto cols = taps(dw, zoomX, originX, sw);
+    auto rows = taps(dh, zoomY, originY, sh);
+    // Visible columns are one contiguous span
+    int begin = 0, end = dw;
+    while (begin < dw && cols[begin].i0 < 0) ++begin;
+    while (end > begin && cols[end - 1].i0 < 0) --end;
+
+    using RowFn = void (*)(const unsigned char*, const unsigned char*, unsigned, const BilinearTap*, int, int,
+                           unsigned char*);
+    static const RowFn kernels[4][2] = {
+        {bilinearRow<1, 3>, bilinearRow<1, 4>}, {bilinearRow<2, 3>, bilinearRow<2, 4>},
+        {bilinearRow<3, 3>, bilinearRow<3, 4>}, {bilinearRow<4, 3>, bilinearRow<4, 4>}};
+    RowFn row = kernels[channels - 1][dstChannels == 4];
+    size_t srcStride = size_t(sw) * channels;
+    parallelFor(dh, [&](int first, int last) {
+        for (int y = first; y < last; ++y) {
+            unsigned char* out = dst + y * dstStride;
+            const BilinearTap& t = rows[y];
+            if (t.i0 < 0 || begin >= end) {
+                std::memset(out, 0, size_t(dw) * dstChannels);
+                continue;
+            }
+            std::memset(out, 0, size_t(begin) * dstChannels);
+            std::memset(out + size_t(end) * dstChannels, 0, size_t(dw - end) * dstChannels);
+            row(src + t.i0 * srcStride, src + t.i1 * srcStride, t.w1, cols.data(), begin, end, out);
+        }
+    });
+}
+
+} // namespace
+
+// ==================== IMAGE ====================
+bool Image::loadFromFile(const std::string& path, const LoadOptions& options) {
+    // Read the bytes once so the content hash costs no extra I/O
+    std::vector<unsigned char> bytes;
+    if (!readFile(path, bytes)) return false;
+    if (!loadFromMemory(bytes.data(), bytes.size(), options)) return false;
+    m_filePath = path;
+    return true;
+}
+
+bool Image::loadFromMemory(const unsigned char* bytes, size_t size, const LoadOptions& options) {
+    if (const RawHeader* raw = rawHeader(bytes, size)) {
+        const unsigned char* pixels = bytes + raw->dataOffset;
+        size_t rowBytes = size_t(raw->width) * raw->channels;
+        std::vector<unsigned char> packed(rowBytes * raw->height);
+        int ts = raw->tileSize;
+        if (ts == 0) {
+            for (int y = 0; y < raw->height; ++y)
+                std::memcpy(&packed[y * rowBytes], pixels + y * raw->stride, rowBytes);
+        } else {
+            int tilesX = (raw->width + ts - 1) / ts;
+            size_t tileBytes = raw->stride * ts;
+            for (int y = 0; y < raw->height; ++y)
+                for (int tx = 0; tx < tilesX; ++tx) {
+                    const unsigned char* tile = pixels + (size_t(y / ts) * tilesX + tx) * tileBytes;
+                    int w = std::min(ts, raw->width - tx * ts);
+                    std::memcpy(&packed[y * rowBytes + size_t(tx) * ts * raw->channels],
+                                tile + (y % ts) * raw->stride, size_t(w) * raw->channels);
+                }
+        }
+        assignDecoded(packed.data(), raw->width, raw->height, raw->channels, options);
+        m_filePath.clear();
+        m_contentHash = xxHash64(bytes, size);
+        return true;
+    }
+
+    int width, height, channels;
+    std::vector<unsigned char> qoi;
+    if (qoiDecode(bytes, size, qoi, width, height, channels)) {
+        assignDecoded(qoi.data(), width, height, channels, options);
+        m_filePath.clear();
+        m_contentHash = xxHash64(bytes, size);
+        return true;
+    }
+
+    unsigned char* data = stbi_load_from_memory(bytes, int(size), &width, &height, &channels, 0);
+    if (!data) return false;
+
+    assignDecoded(data, width, height, channels, options);
+    stbi_image_free(data);
+    m_filePath.clear();
+    m_contentHash = xxHash64(bytes, size);
+    return true;
+}
+
+void Image::assignDecoded(const unsigned char* data, int width, int height, int channels,
+                          const LoadOptions& options) {
+    float limit = 1.0f;
+    if (options.maxWidth > 0) limit = std::min(limit, float(options.maxWidth) / width);
+    if (options.maxHeight > 0) limit = std::min(limit, float(options.maxHeight) / height);
+    if (limit < 1.0f) {
+        // stb has no DCT-domain scaling, so shrink straight out of the decoder buffer
+        m_width = std::max(1, int(width * limit));
+        m_height = std::max(1, int(height * limit));
+        m_channels = channels;
+        m_palette.clear();
+        m_paletteChannels = 0;
+        m_pixels.resize(size_t(m_width) * m_height * channels);
+        boxResample(data, width, height, channels, m_pixels.data(), m_width, m_height);
+    } else {
+        updatePixelData(data, width, height, channels);
+    }
+    if (options.compactChannels) compactChannels();
+    if (options.indexed) toIndexed();
+}
+
+bool Image::loadPartial(const std::string& path, int x, int y, int w, int h) {
+    int width, height, channels;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 0);
+    if (!data) return false;
+    if (x < 0 || y < 0 || x + w > width || y + h > height) {
+        stbi_image_free(data);
+        return false;
+    }
+
+    std::vector<unsigned char> partialPixels(w * h * channels);
+    for (int row = 0; row < h; ++row) {
+        std::memcpy(&partialPixels[row * w * channels],
+                    &data[((y + row) * width + x) * channels],
+                    w * channels);
+    }
+    updatePixelData(partialPixels.data(), w, h, channels);
+    stbi_image_free(data);
+    return true;
+}
+
+int Image::width() const { return m_width; }
+uint64_t Image::contentHash() const { return m_contentHash; }
+int Image::height() const { return m_height; }
+const unsigned char* Image::data() const { return m_pixels.data(); }
+
+ImageView Image::view() const {
+    return ImageView{m_pixels.data(), m_width, m_height, m_channels, size_t(m_width) * m_channels};
+}
+
+bool Image::loadFromView(const ImageView& view) {
+    if (!view.data || view.width <= 0 || view.height <= 0 || view.channels <= 0) return false;
+    size_t rowBytes = size_t(view.width) * view.channels;
+    m_pixels.resize(rowBytes * view.height);
+    for (int y = 0; y < view.height; ++y)
+        std::memcpy(&m_pixels[y * rowBytes], view.data + y * view.stride, rowBytes);
+    m_width = view.width;
+    m_height = view.height;
+    m_channels = view.channels;
+    m_palette.clear();
+    m_paletteChannels = 0;
+    m_filePath.clear();
+    m_contentHash = 0;
+    return true;
+}
+int Image::channels() const { return isIndexed() ? m_paletteChannels : m_channels; }
+
+bool Image::hasAlpha() const {
+    if (isIndexed()) {
+        if (m_paletteChannels != 2 && m_paletteChannels != 4) return false;
+        return !alphaOpaque(m_palette.data(), m_palette.size() / m_paletteChannels, m_paletteChannels);
+    }
+    if (m_channels != 2 && m_channels != 4) return false;
+    return !alphaOpaque(m_pixels.data(), size_t(m_width) * m_height, m_channels);
+}
+
+bool Image::compactChannels() {
+    if (isIndexed()) {
+        // Only the palette needs rewriting; every entry is in use
+        int channels = compactPixels(m_palette, m_palette.size() / m_paletteChannels, m_paletteChannels);
+        if (channels == m_paletteChannels) return false;
+        m_paletteChannels = channels;
+        return true;
+    }
+    int channels = compactPixels(m_pixels, size_t(m_width) * m_height, m_channels);
+    if (channels == m_channels) return false;
+    m_channels = channels;
+    return true;
+}
+
+bool Image::isIndexed() const { return !m_palette.empty(); }
+const std::vector<unsigned char>& Image::palette() const { return m_palette; }
+
+bool Image::toIndexed() {
+    if (isIndexed() || m_channels < 2 || m_pixels.empty()) return false;
+    size_t count = size_t(m_width) * m_height;
+
+    // Open-addressing table of packed colors; 512 slots keep probes short for 256 entries
+    uint32_t keys[512];
+    int slots[512];
+    std::fill(std::begin(slots), std::end(slots), -1);
+    std::vector<unsigned char> palette;
+    std::vector<unsigned char> indices(count);
+    uint32_t lastKey = 0;
+    int lastIndex = -1;
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char* px = &m_pixels[i * m_channels];
+        uint32_t key = 0;
+        std::memcpy(&key, px, m_channels);
+        if (key != lastKey || lastIndex < 0) { // runs of one color skip the lookup
+            uint32_t slot = (key * 2654435761u) >> 23;
+            while (slots[slot] >= 0 && keys[slot] != key) slot = (slot + 1) & 511;
+            if (slots[slot] < 0) {
+                int entries = int(palette.size() / m_channels);
+                if (entries == 256) return false;
+                keys[slot] = key;
+                slots[slot] = entries;
+                palette.insert(palette.end(), px, px + m_channels);
+            }
+            lastKey = key;
+            lastIndex = slots[slot];
+        }
+        indices[i] = (unsigned char)lastIndex;
+    }
+    m_palette = std::move(palette);
+    m_paletteChannels = m_channels;
+    m_pixels = std::move(indices);
+    m_channels = 1;
+    return true;
+}
+
+void Image::expandPalette() {
+    if (!isIndexed()) return;
+    size_t count = size_t(m_width) * m_height;
+    int channels = m_paletteChannels;
+    std::vector<unsigned char> expanded(count * channels);
+    for (size_t i = 0; i < count; ++i)
+        std::memcpy(&expanded[i * channels], &m_palette[m_pixels[i] * channels], channels);
+    m_pixels = std::move(expanded);
+    m_channels = channels;
+    m_palette.clear();
+    m_paletteChannels = 0;
+}
+
+bool Image::crop(int x, int y, int width, int height) {
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > m_width || y + height > m_height)
+        return false;
+    // Rows move towards the front, so copy in place front to back
+    size_t rowBytes = size_t(width) * m_channels;
+    for (int row = 0; row < height; ++row)
+        std::memmove(&m_pixels[row * rowBytes], &m_pixels[(size_t(y + row) * m_width + x) * m_channels], rowBytes);
+    m_pixels.resize(rowBytes * height);
+    m_width = width;
+    m_height = height;
+    return true;
+}
+
+void Image::updatePixelData(const unsigned char* data, int width, int height, int channels) {
+    m_palette.clear();
+    m_paletteChannels = 0;
+    m_width = width;
+    m_height = height;
+    m_channels = channels;
+    m_pixels.assign(data, data + width * height * channels);
+}
+
+void Image::rotateClockwise() {
+    std::vector<unsigned char> rotated(m_pixels.size());
+    for (int y = 0; y < m_height; ++y) {
+        for (int x = 0; x < m_width; ++x) {
+            for (int c = 0; c < m_channels; ++c) {
+                rotated[(x * m_height + (m_height - y - 1)) * m_channels + c] =
+                    m_pixels[(y * m_width + x) * m_channels + c];
+            }
+        }
+    }
+    std::swap(m_width, m_height);
+    m_pixels = std::move(rotated);
+}
+
+void Image::rotateCounterClockwise() {
+    rotateClockwise();
+    rotateClockwise();
+    rotateClockwise();
+}
+
+void Image::scale(float factor) {
+    if (factor <= 0) return;
+    int newW = int(m_width * factor);
+    int newH = int(m_height * factor);
+    std::vector<unsigned char> newPixels(newW * newH * m_channels);
+
+    for (int y = 0; y < newH; ++y) {
+        for (int x = 0; x < newW; ++x) {
+            int srcX = int(x / factor);
+            int srcY = int(y / factor);
+            for (int c = 0; c < m_channels; ++c) {
+                newPixels[(y * newW + x) * m_channels + c] =
+                    m_pixels[(srcY * m_width + srcX) * m_channels + c];
+            }
+        }
+    }
+    m_pixels = std::move(newPixels);
+    m_width = newW;
+    m_height = newH;
+}
+
+void Image::rotateClockwiseInPlace() {
+    if (m_pixels.empty()) return;
+    // Clockwise = transpose, then mirror each row
+    transposeInPlace(m_pixels.data(), m_width, m_height, m_channels);
+    std::swap(m_width, m_height);
+    size_t stride = size_t(m_width) * m_channels;
+    for (int y = 0; y < m_height; ++y) reverseRowPixels(&m_pixels[y * stride], m_width, m_channels);
+}
+
+void Image::rotateCounterClockwiseInPlace() {
+    if (m_pixels.empty()) return;
+    transposeInPlace(m_pixels.data(), m_width, m_height, m_channels);
+    std::swap(m_width, m_height);
+    flipVertical();
+}
+
+void Image::rotate180() {
+    if (m_pixels.empty()) return;
+    reverseRowPixels(m_pixels.data(), m_width * m_height, m_channels);
+}
+
+void Image::flipHorizontal() {
+    size_t stride = size_t(m_width) * m_channels;
+    for (int y = 0; y < m_height; ++y) reverseRowPixels(&m_pixels[y * stride], m_width, m_channels);
+}
+
+void Image::flipVertical() {
+    size_t stride = size_t(m_width) * m_channels;
+    for (int a = 0, b = m_height - 1; a < b; ++a, --b)
+        std::swap_ranges(m_pixels.begin() + a * stride, m_pixels.begin() + (a + 1) * stride, m_pixels.begin() + b * stride);
+}
+
+void Image::scaleInPlace(float factor) {
+    if (m_pixels.empty() || factor <= 0 || factor >= 1) return;
+    int newW = std::max(1, int(m_width * factor));
+    int newH = std::max(1, int(m_height * factor));
+    // Every source box starts at or after the output pixel it feeds, so a
+    // single forward pass never overwrites pixels it has yet to read
+    unsigned char* px = m_pixels.data();
+    for (int y = 0; y < newH; ++y) {
+        int y0 = int(int64_t(y) * m_height / newH);
+        int y1 = std::max(y0 + 1, int(int64_t(y + 1) * m_height / newH));
+        for (int x = 0; x < newW; ++x) {
+            int x0 = int(int64_t(x) * m_width / newW);
+            int x1 = std::max(x0 + 1, int(int64_t(x + 1) * m_width / newW));
+            unsigned char* dst = px + (size_t(y) * newW + x) * m_channels;
+            if (isIndexed()) {
+                // Indices cannot be averaged: nearest (box corner) sample
+                *dst = px[size_t(y0) * m_width + x0];
+                continue;
+            }
+            unsigned sum[4] = {0, 0, 0, 0};
+            for (int sy = y0; sy < y1; ++sy) {
+                const unsigned char* row = px + (size_t(sy) * m_width + x0) * m_channels;
+                for (int sx = x0; sx < x1; ++sx, row += m_channels)
+                    for (int c = 0; c < m_channels; ++c) sum[c] += row[c];
+            }
+            unsigned area = unsigned((y1 - y0) * (x1 - x0));
+            for (int c = 0; c < m_channels; ++c) dst[c] = (unsigned char)((sum[c] + area / 2) / area);
+        }
+    }
+    m_pixels.resize(size_t(newW) * newH * m_channels);
+    m_width = newW;
+    m_height = newH;
+}
+
+void Image::resize(int width, int height, FitMode mode) {
+    if (m_pixels.empty() || width <= 0 || height <= 0) return;
+    expandPalette();
+    Rect region;
+    int outW, outH;
+    fitRegion(mode, m_width, m_height, width, height, region, outW, outH);
+    std::vector<unsigned char> resized(size_t(outW) * outH * m_channels);
+    resampleRegion(m_pixels.data(), m_width, m_channels, region, resized.data(), outW, outH);
+    m_pixels = std::move(resized);
+    m_width = outW;
+    m_height = outH;
+}
+
+// Filters (basic)
+void Image::applyFilter(FilterType type) {
+    // Point filters on an indexed image only touch the palette
+    if (isIndexed()) filterPixels(m_palette, m_paletteChannels, type);
+    else filterPixels(m_pixels, m_channels, type);
+}
+
+bool Image::saveAs(const std::string& path, ImageFormat format) {
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.saveAs(path, format);
+    }
+    int success = 0;
+    switch(format) {
+        case ImageFormat::PNG:
+            success = stbi_write_png(path.c_str(), m_width, m_height, m_channels, m_pixels.data(), m_width*m_channels);
+            break;
+        case ImageFormat::JPEG:
+            success = stbi_write_jpg(path.c_str(), m_width, m_height, m_channels, m_pixels.data(), 90);
+            break;
+        case ImageFormat::BMP:
+            success = stbi_write_bmp(path.c_str(), m_width, m_height, m_channels, m_pixels.data());
+            break;
+        case ImageFormat::TGA:
+            success = stbi_write_tga(path.c_str(), m_width, m_height, m_channels, m_pixels.data());
+            break;
+        case ImageFormat::QOI: {
+            std::vector<unsigned char> encoded;
+            if (!qoiEncode(m_pixels.data(), m_width, m_height, m_channels, encoded)) return false;
+            std::ofstream file(path, std::ios::binary);
+            success = file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size()) ? 1 : 0;
+            break;
+        }
+        default:
+            return false;
+    }
+    return success != 0;
+}
+
+bool Image::saveToMemory(std::vector<unsigned char>& out, ImageFormat format) const {
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.saveToMemory(out, format);
+    }
+    out.clear();
+    int success = 0;
+    switch(format) {
+        case ImageFormat::PNG:
+            success = stbi_write_png_to_func(appendToVector, &out, m_width, m_height, m_channels, m_pixels.data(), m_width*m_channels);
+            break;
+        case ImageFormat::JPEG:
+            success = stbi_write_jpg_to_func(appendToVector, &out, m_width, m_height, m_channels, m_pixels.data(), 90);
+            break;
+        case ImageFormat::BMP:
+            success = stbi_write_bmp_to_func(appendToVector, &out, m_width, m_height, m_channels, m_pixels.data());
+            break;
+        case ImageFormat::TGA:
+            success = stbi_write_tga_to_func(appendToVector, &out, m_width, m_height, m_channels, m_pixels.data());
+            break;
+        case ImageFormat::QOI:
+            success = qoiEncode(m_pixels.data(), m_width, m_height, m_channels, out) ? 1 : 0;
+            break;
+        default:
+            return false;
+    }
+    return success != 0;
+}
+
+bool Image::saveRaw(const std::string& path, int tileSize) const {
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.saveRaw(path, tileSize);
+    }
+    if (m_pixels.empty() || tileSize < 0 || tileSize > kRawMaxTileSize) return false;
+    RawHeader header = {};
+    std::memcpy(header.magic, kRawMagic, 4);
+    header.version = 1;
+    header.width = m_width;
+    header.height = m_height;
+    header.channels = m_channels;
+    header.tileSize = tileSize;
+    size_t rowBytes = size_t(m_width) * m_channels;
+    header.stride = tileSize > 0 ? size_t(tileSize) * m_channels : (rowBytes + 63) & ~size_t(63);
+    header.dataOffset = sizeof(RawHeader);
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::vector<char> padded(header.stride, 0);
+    if (tileSize == 0) {
+        for (int y = 0; y < m_height; ++y) {
+            std::memcpy(padded.data(), &m_pixels[y * rowBytes], rowBytes);
+            file.write(padded.data(), padded.size());
+        }
+    } else {
+        // Edge tiles are zero-padded to full size so every tile has the same offset math
+        int tilesX = (m_width + tileSize - 1) / tileSize;
+        int tilesY = (m_height + tileSize - 1) / tileSize;
+        for (int ty = 0; ty < tilesY; ++ty)
+            for (int tx = 0; tx < tilesX; ++tx)
+                for (int row = 0; row < tileSize; ++row) {
+                    std::fill(padded.begin(), padded.end(), 0);
+                    int y = ty * tileSize + row;
+                    int w = std::min(tileSize, m_width - tx * tileSize);
+                    if (y < m_height)
+                        std::memcpy(padded.data(), &m_pixels[y * rowBytes + size_t(tx) * tileSize * m_channels],
+                                    size_t(w) * m_channels);
+                    file.write(padded.data(), padded.size());
+                }
+    }
+    return bool(file);
+}
+
+std::shared_ptr<Image> Image::generateThumbnail(int maxWidth, int maxHeight) {
+    float scaleFactor = std::min(float(maxWidth)/m_width, float(maxHeight)/m_height);
+    auto thumb = std::make_shared<Image>();
+    int w = int(m_width * scaleFactor), h = int(m_height * scaleFactor);
+    if (m_pixels.empty() || w <= 0 || h <= 0) return thumb;
+    thumb->m_width = w;
+    thumb->m_height = h;
+    thumb->m_channels = m_channels;
+    thumb->m_pixels.resize(size_t(w) * h * m_channels);
+    if (isIndexed()) {
+        // Nearest-neighbour keeps the indices valid
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+                thumb->m_pixels[size_t(y) * w + x] =
+                    m_pixels[size_t(std::min(m_height - 1, int(y / scaleFactor))) * m_width +
+                             std::min(m_width - 1, int(x / scaleFactor))];
+        thumb->m_palette = m_palette;
+        thumb->m_paletteChannels = m_paletteChannels;
+    } else {
+        // Resample straight from this image; no full-size copy
+        resampleRegion(m_pixels.data(), m_width, m_channels, Rect{0, 0, m_width, m_height},
+                       thumb->m_pixels.data(), w, h);
+    }
+    return thumb;
+}
+
+std::vector<std::shared_ptr<Image>> Image::generateThumbnails(const std::vector<ThumbnailSpec>& specs) const {
+    return generateThumbnails(specs, m_width, m_height);
+}
+
+std::vector<std::shared_ptr<Image>> Image::generateThumbnails(const std::vector<ThumbnailSpec>& specs,
+                                                              int fitWidth, int fitHeight) const {
+    std::vector<std::shared_ptr<Image>> thumbs(specs.size());
+    if (m_pixels.empty() || fitWidth <= 0 || fitHeight <= 0) return thumbs;
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.generateThumbnails(specs, fitWidth, fitHeight);
+    }
+    // Maps a fitted region onto a width x height image of the same content
+    auto scaleRegion = [&](const Rect& r, int width, int height) {
+        int x0 = int(int64_t(r.x) * width / fitWidth), x1 = int((int64_t(r.x) + r.width) * width / fitWidth);
+        int y0 = int(int64_t(r.y) * height / fitHeight), y1 = int((int64_t(r.y) + r.height) * height / fitHeight);
+        x0 = std::min(x0, width - 1);
+        y0 = std::min(y0, height - 1);
+        return Rect{x0, y0, std::max(1, x1 - x0), std::max(1, y1 - y0)};
+    };
+
+    // Halving cascade: level n is built from level n - 1, never from the source
+    struct Level {
+        int width, height;
+        std::vector<unsigned char> pixels;
+    };
+    std::vector<Level> levels;
+    auto level = [&](int n) -> const Level& {
+        while (int(levels.size()) < n) {
+            const unsigned char* src = levels.empty() ? m_pixels.data() : levels.back().pixels.data();
+            int sw = levels.empty() ? m_width : levels.back().width;
+            int sh = levels.empty() ? m_height : levels.back().height;
+            Level next{std::max(1, sw / 2), std::max(1, sh / 2), {}};
+            next.pixels.resize(size_t(next.width) * next.height * m_channels);
+            boxResample(src, sw, sh, m_channels, next.pixels.data(), next.width, next.height);
+            levels.push_back(std::move(next));
+        }
+        return levels[n - 1];
+    };
+
+    // Largest outputs first so each level is built once
+    std::vector<size_t> order(specs.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return int64_t(specs[a].width) * specs[a].height > int64_t(specs[b].width) * specs[b].height;
+    });
+    for (size_t i : order) {
+        const ThumbnailSpec& spec = specs[i];
+        if (spec.width <= 0 || spec.height <= 0) continue;
+        // Output size comes from the fitted dimensions alone; only the
+        // region is mapped onto whichever level is sampled
+        Rect fitted;
+        int outW, outH;
+        fitRegion(spec.mode, fitWidth, fitHeight, spec.width, spec.height, fitted, outW, outH);
+        Rect region = scaleRegion(fitted, m_width, m_height);
+        double needed = std::max(double(outW) / region.width, double(outH) / region.height);
+        int n = 0;
+        while (needed * 2 <= 1.0 && (m_width >> (n + 1)) > 0 && (m_height >> (n + 1)) > 0) {
+            needed *= 2;
+            ++n;
+        }
+        const unsigned char* src = m_pixels.data();
+        int sw = m_width, sh = m_height;
+        if (n > 0) {
+            const Level& l = level(n);
+            src = l.pixels.data();
+            sw = l.width;
+            sh = l.height;
+            region = scaleRegion(fitted, sw, sh);
+        }
+        auto thumb = std::make_shared<Image>();
+        thumb->m_width = outW;
+        thumb->m_height = outH;
+        thumb->m_channels = m_channels;
+        thumb->m_pixels.resize(size_t(outW) * outH * m_channels);
+        resampleRegion(src, sw, m_channels, region, thumb->m_pixels.data(), outW, outH);
+        thumbs[i] = thumb;
+    }
+
+    parallelFor(int(specs.size()), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            if (thumbs[i] && !specs[i].path.empty() && !thumbs[i]->saveAs(specs[i].path, specs[i].format))
+                thumbs[i].reset();
+    });
+    return thumbs;
+}
+
+std::vector<std::shared_ptr<Image>> Image::generateThumbnails(const std::string& path,
+                                                              const std::vector<ThumbnailSpec>& specs) {
+    std::vector<unsigned char> bytes;
+    if (!readFile(path, bytes)) return std::vector<std::shared_ptr<Image>>(specs.size());
+
+    // Keep only as much resolution as the largest output needs
+    LoadOptions options;
+    int sw = 0, sh = 0, channels;
+    if (stbi_info_from_memory(bytes.data(), int(bytes.size()), &sw, &sh, &channels)) {
+        double needed = 0;
+        for (const auto& spec : specs) {
+            if (spec.width <= 0 || spec.height <= 0) continue;
+            Rect region;
+            int outW, outH;
+            fitRegion(spec.mode, sw, sh, spec.width, spec.height, region, outW, outH);
+            needed = std::max(needed, std::max(double(outW) / region.width, double(outH) / region.height));
+        }
+        if (needed > 0 && needed < 1) {
+            options.maxWidth = std::max(1, int(std::ceil(sw * needed)));
+            options.maxHeight = std::max(1, int(std::ceil(sh * needed)));
+        }
+    }
+    Image source;
+    if (!source.loadFromMemory(bytes.data(), bytes.size(), options))
+        return std::vector<std::shared_ptr<Image>>(specs.size());
+    if (options.maxWidth > 0) return source.generateThumbnails(specs, sw, sh);
+    return source.generateThumbnails(specs);
+}
+
+int Image::otsuThreshold() const {
+    if (m_pixels.empty()) return 0;
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.otsuThreshold();
+    }
+    uint64_t hist[256];
+    if (m_channels == 1) {
+        grayHistogram(m_pixels.data(), m_width, m_height, hist);
+    } else {
+        auto gray = grayPlane(m_pixels.data(), m_width, m_height, m_channels);
+        grayHistogram(gray.data(), m_width, m_height, hist);
+    }
+    return otsuFromHistogram(hist);
+}
+
+void Image::binarize(ThresholdMethod method, int window, float k) {
+    if (m_pixels.empty()) return;
+    expandPalette();
+    auto gray = m_channels == 1 ? m_pixels : grayPlane(m_pixels.data(), m_width, m_height, m_channels);
+    std::vector<unsigned char> out(size_t(m_width) * m_height);
+    thresholdRows(gray.data(), m_width, m_height, method, window, k,
+                  [&](int y, const unsigned char* mask) {
+                      unsigned char* dst = &out[size_t(y) * m_width];
+                      for (int x = 0; x < m_width; ++x) dst[x] = mask[x] ? 255 : 0;
+                  });
+    m_pixels = std::move(out);
+    m_channels = 1;
+}
+
+void Image::erodeOrDilate(bool erode, int kernelWidth, int kernelHeight) {
+    auto minOp = [](unsigned char a, unsigned char b) { return std::min(a, b); };
+    auto maxOp = [](unsigned char a, unsigned char b) { return std::max(a, b); };
+    // Rectangles are separable: a horizontal then a vertical 1-D pass
+    if (erode) {
+        vanHerkRows(m_pixels.data(), m_width, m_height, m_channels, kernelWidth, 255, minOp);
+        vanHerkColumns(m_pixels.data(), size_t(m_width) * m_channels, m_height, kernelHeight,
+                       (unsigned char)255, minOp);
+    } else {
+        vanHerkRows(m_pixels.data(), m_width, m_height, m_channels, kernelWidth, 0, maxOp);
+        vanHerkColumns(m_pixels.data(), size_t(m_width) * m_channels, m_height, kernelHeight,
+                       (unsigned char)0, maxOp);
+    }
+}
+
+void Image::morphology(MorphOp op, int kernelWidth, int kernelHeight) {
+    if (m_pixels.empty() || kernelWidth < 1 || kernelHeight < 1) return;
+    expandPalette();
+    switch (op) {
+        case MorphOp::Erode:
+            erodeOrDilate(true, kernelWidth, kernelHeight);
+            break;
+        case MorphOp::Dilate:
+            erodeOrDilate(false, kernelWidth, kernelHeight);
+            break;
+        case MorphOp::Open:
+            erodeOrDilate(true, kernelWidth, kernelHeight);
+            erodeOrDilate(false, kernelWidth, kernelHeight);
+            break;
+        case MorphOp::Close:
+            erodeOrDilate(false, kernelWidth, kernelHeight);
+            erodeOrDilate(true, kernelWidth, kernelHeight);
+            break;
+    }
+}
+
+void Image::medianFilter(int radius) {
+    if (m_pixels.empty() || radius < 1) return;
+    expandPalette();
+    std::vector<unsigned char> out(m_pixels.size());
+    const int w = m_width, h = m_height, ch = m_channels, r = radius;
+    const uint32_t half = uint32_t((2 * r + 1) * (2 * r + 1)) / 2;
+    auto clampX = [w](int x) { return std::min(w - 1, std::max(0, x)); };
+    auto clampY = [h](int y) { return std::min(h - 1, std::max(0, y)); };
+
+    // Perreault-Hebert: every column keeps a 256-bin fine and a 16-bin coarse
+    // histogram of its 2r + 1 rows. Sliding the kernel touches only the coarse
+    // level; a fine segment of the kernel histogram is brought up to date when
+    // the median search lands in it. Vertical strips (plus halo) run in parallel.
+    const int stripWidth = 256;
+    int strips = (w + stripWidth - 1) / stripWidth;
+    parallelFor(strips * ch, [&](int begin, int end) {
+        for (int job = begin; job < end; ++job) {
+            int c = job % ch;
+            int x0 = (job / ch) * stripWidth, x1 = std::min(w, x0 + stripWidth);
+            int c0 = std::max(0, x0 - r), c1 = std::min(w, x1 + r); // columns with histograms
+            std::vector<uint16_t> cols(size_t(c1 - c0) * 256, 0), colsCoarse(size_t(c1 - c0) * 16, 0);
+            auto px = [&](int x, int y) { return m_pixels[(size_t(y) * w + x) * ch + c]; };
+            for (int x = c0; x < c1; ++x)
+                for (int dy = -r; dy <= r; ++dy) {
+                    unsigned char v = px(x, clampY(dy));
+                    ++cols[size_t(x - c0) * 256 + v];
+                    ++colsCoarse[size_t(x - c0) * 16 + v / 16];
+                }
+
+            for (int y = 0; y < h; ++y) {
+                uint32_t fine[256], coarse[16] = {};
+                int fineAt[16]; // kernel centre each fine segment was last valid for
+                std::fill(fineAt, fineAt + 16, x0 - 2 * r - 2);
+                for (int dx = -r; dx <= r; ++dx) {
+                    const uint16_t* col = &colsCoarse[size_t(clampX(x0 + dx) - c0) * 16];
+                    for (int b = 0; b < 16; ++b) coarse[b] += col[b];
+                }
+                for (int x = x0; x < x1; ++x) {
+                    uint32_t seen = 0;
+                    int b = 0;
+                    while (seen + coarse[b] <= half) seen += coarse[b++];
+
+                    uint32_t* segment = &fine[b * 16];
+                    if (x - fineAt[b] > 2 * r + 1) { // cheaper to rebuild than to slide
+                        std::fill(segment, segment + 16, 0);
+                        for (int dx = -r; dx <= r; ++dx) {
+                            const uint16_t* col = &cols[size_t(clampX(x + dx) - c0) * 256 + b * 16];
+                            for (int v = 0; v < 16; ++v) segment[v] += col[v];
+                        }
+                    } else {
+                        for (int cx = fineAt[b] + 1; cx <= x; ++cx) {
+                            const uint16_t* add = &cols[size_t(clampX(cx + r) - c0) * 256 + b * 16];
+                            const uint16_t* sub = &cols[size_t(clampX(cx - r - 1) - c0) * 256 + b * 16];
+                            for (int v = 0; v < 16; ++v) segment[v] += uint32_t(add[v]) - sub[v];
+                        }
+                    }
+                    fineAt[b] = x;
+
+                    int v = 0;
+                    while (seen + segment[v] <= half) seen += segment[v++];
+                    out[(size_t(y) * w + x) * ch + c] = (unsigned char)(b * 16 + v);
+                    if (x + 1 < x1) {
+                        const uint16_t* add = &colsCoarse[size_t(clampX(x + r + 1) - c0) * 16];
+                        const uint16_t* sub = &colsCoarse[size_t(clampX(x - r) - c0) * 16];
+                        for (int k = 0; k < 16; ++k) coarse[k] += uint32_t(add[k]) - sub[k];
+                    }
+                }
+                if (y + 1 < h)
+                    for (int x = c0; x < c1; ++x) {
+                        unsigned char sub = px(x, clampY(y - r)), add = px(x, clampY(y + r + 1));
+                        --cols[size_t(x - c0) * 256 + sub];
+                        --colsCoarse[size_t(x - c0) * 16 + sub / 16];
+                        ++cols[size_t(x - c0) * 256 + add];
+                        ++colsCoarse[size_t(x - c0) * 16 + add / 16];
+                    }
+            }
+        }
+    });
+    m_pixels = std::move(out);
+}
+
+void Image::bilateralFilter(float sigmaSpatial, float sigmaRange) {
+    if (m_pixels.empty() || sigmaSpatial <= 0 || sigmaRange <= 0) return;
+    expandPalette();
+    // Grid cells are one sigma wide; splat, blur with [1 4 6 4 1] per axis, slice.
+    // Cells are (gy, gx, gz) with gz fastest; every pass is split by gy so
+    // threads write disjoint grid rows and share no buffers.
+    const int w = m_width, h = m_height, ch = m_channels;
+    // Sigmas below a pixel or gray level buy nothing, and the grid is capped
+    // at about one cell per pixel by coarsening both sigmas together, so
+    // tiny sigmas cannot allocate buffers many times the image size
+    sigmaSpatial = std::max(sigmaSpatial, 1.0f);
+    sigmaRange = std::max(sigmaRange, 1.0f);
+    const size_t maxCells = std::max(size_t(w) * h, size_t(4096));
+    int gw, gh, gd;
+    for (;; sigmaSpatial *= 1.25f, sigmaRange *= 1.25f) {
+        gw = int(w / sigmaSpatial) + 4, gh = int(h / sigmaSpatial) + 4, gd = int(255 / sigmaRange) + 4;
+        if (size_t(gw) * gh * gd <= maxCells) break;
+    }
+    const size_t cells = size_t(gw) * gh * gd, rowCells = size_t(gw) * gd;
+    auto cell = [&](int gx, int gy, int gz) { return (size_t(gy) * gw + gx) * gd + gz; };
+    const float taps[5] = {1, 4, 6, 4, 1};
+
+    for (int c = 0; c < ch; ++c) {
+        std::vector<float> value(cells, 0.0f), weight(cells, 0.0f);
+        parallelFor(gh, [&](int begin, int end) {
+            for (int y = 0; y < h; ++y) {
+                int gy = int(y / sigmaSpatial + 0.5f) + 2;
+                if (gy < begin || gy >= end) continue;
+                for (int x = 0; x < w; ++x) {
+                    unsigned char p = m_pixels[(size_t(y) * w + x) * ch + c];
+                    size_t i = cell(int(x / sigmaSpatial + 0.5f) + 2, gy, int(p / sigmaRange + 0.5f) + 2);
+                    value[i] += p;
+                    weight[i] += 1.0f;
+                }
+            }
+        });
+
+        // Cells past either end of an axis count as empty
+        std::vector<float> tmpV(cells), tmpW(cells);
+        auto blurRange = [&](const float* src, float* dst, int index, int length, size_t span) {
+            float* d = dst + size_t(index) * span;
+            for (size_t i = 0; i < span; ++i) d[i] = 0;
+            for (int k = 0; k < 5; ++k) {
+                int q = index + k - 2;
+                if (q < 0 || q >= length) continue;
+                const float* s = src + size_t(q) * span;
+                for (size_t i = 0; i < span; ++i) d[i] += taps[k] * s[i];
+            }
+        };
+        auto blurAxis = [&](int axis) {
+            parallelFor(gh, [&](int begin, int end) {
+                for (int gy = begin; gy < end; ++gy) {
+                    if (axis == 2) { // across grid rows
+                        blurRange(value.data(), tmpV.data(), gy, gh, rowCells);
+                        blurRange(weight.data(), tmpW.data(), gy, gh, rowCells);
+                    } else if (axis == 1) { // across columns, all depths at once
+                        for (int gx = 0; gx < gw; ++gx) {
+                            blurRange(&value[gy * rowCells], &tmpV[gy * rowCells], gx, gw, size_t(gd));
+                            blurRange(&weight[gy * rowCells], &tmpW[gy * rowCells], gx, gw, size_t(gd));
+                        }
+                    } else { // along depth
+                        for (size_t i = gy * rowCells; i < (gy + 1) * rowCells; i += gd)
+                            for (int gz = 0; gz < gd; ++gz) {
+                                float sv = 0, sw = 0;
+                                for (int k = std::max(0, 2 - gz); k < std::min(5, gd + 2 - gz); ++k) {
+                                    sv += taps[k] * value[i + gz + k - 2];
+                                    sw += taps[k] * weight[i + gz + k - 2];
+                                }
+                                tmpV[i + gz] = sv;
+                                tmpW[i + gz] = sw;
+                            }
+                    }
+                }
+            });
+            value.swap(tmpV);
+            weight.swap(tmpW);
+        };
+        blurAxis(0);
+        blurAxis(1);
+        blurAxis(2);
+
+        parallelFor(h, [&](int begin, int end) {
+            for (int y = begin; y < end; ++y)
+                for (int x = 0; x < w; ++x) {
+                    unsigned char& p = m_pixels[(size_t(y) * w + x) * ch + c];
+                    float fx = x / sigmaSpatial + 2, fy = y / sigmaSpatial + 2, fz = p / sigmaRange + 2;
+                    int ix = int(fx), iy = int(fy), iz = int(fz);
+                    float ax = fx - ix, ay = fy - iy, az = fz - iz;
+                    float sv = 0, sw = 0;
+                    for (int k = 0; k < 8; ++k) {
+                        float f = ((k & 1) ? ax : 1 - ax) * ((k & 2) ? ay : 1 - ay) * ((k & 4) ? az : 1 - az);
+                        size_t i = cell(ix + (k & 1), iy + ((k >> 1) & 1), iz + ((k >> 2) & 1));
+                        sv += f * value[i];
+                        sw += f * weight[i];
+                    }
+                    if (sw > 0) p = (unsigned char)std::min(255.0f, std::max(0.0f, sv / sw + 0.5f));
+                }
+        });
+    }
+}
+
+// Separable derivative kernels: smoothing [a b a] times difference [-1 0 1]
+void Image::gradientXY(GradientOperator op, std::vector<float>& gx, std::vector<float>& gy) const {
+    std::vector<unsigned char> converted;
+    const unsigned char* gray = m_pixels.data();
+    if (m_channels != 1 || isIndexed()) {
+        if (isIndexed()) {
+            Image expanded(*this);
+            expanded.expandPalette();
+            converted = grayPlane(expanded.m_pixels.data(), m_width, m_height, expanded.m_channels);
+        } else {
+            converted = grayPlane(m_pixels.data(), m_width, m_height, m_channels);
+        }
+        gray = converted.data();
+    }
+    const int w = m_width, h = m_height;
+    const float a = op == GradientOperator::Scharr ? 3.0f : 1.0f;
+    const float b = op == GradientOperator::Scharr ? 10.0f : 2.0f;
+    const float norm = 1.0f / (2 * a + b);
+    gx.assign(size_t(w) * h, 0.0f);
+    gy.assign(size_t(w) * h, 0.0f);
+    parallelFor(h, [&](int begin, int end) {
+        std::vector<float> smoothX(w), diffY(w);
+        for (int y = begin; y < end; ++y) {
+            const unsigned char* up = gray + size_t(std::max(0, y - 1)) * w;
+            const unsigned char* mid = gray + size_t(y) * w;
+            const unsigned char* down = gray + size_t(std::min(h - 1, y + 1)) * w;
+            // Vertical pass: smoothing for gx, difference for gy
+            for (int x = 0; x < w; ++x) {
+                smoothX[x] = a * up[x] + b * mid[x] + a * down[x];
+                diffY[x] = float(down[x]) - float(up[x]);
+            }
+            float* ox = &gx[size_t(y) * w];
+            float* oy = &gy[size_t(y) * w];
+            for (int x = 0; x < w; ++x) {
+                int l = std::max(0, x - 1), r = std::min(w - 1, x + 1);
+                ox[x] = (smoothX[r] - smoothX[l]) * norm;
+                oy[x] = (a * diffY[l] + b * diffY[x] + a * diffY[r]) * norm;
+            }
+        }
+    });
+}
+
+void Image::gradients(GradientOperator op, std::vector<float>& magnitude, std::vector<float>& orientation) const {
+    std::vector<float> gx, gy;
+    gradientXY(op, gx, gy);
+    magnitude.resize(gx.size());
+    orientation.resize(gx.size());
+    parallelFor(m_height, [&](int begin, int end) {
+        for (size_t i = size_t(begin) * m_width; i < size_t(end) * m_width; ++i) {
+            magnitude[i] = std::sqrt(gx[i] * gx[i] + gy[i] * gy[i]);
+            orientation[i] = std::atan2(gy[i], gx[i]);
+        }
+    });
+}
+
+std::shared_ptr<Image> Image::gradientMagnitude(GradientOperator op) const {
+    auto result = std::make_shared<Image>();
+    if (m_pixels.empty()) return result;
+    std::vector<float> gx, gy;
+    gradientXY(op, gx, gy);
+    std::vector<unsigned char> out(gx.size());
+    parallelFor(m_height, [&](int begin, int end) {
+        for (size_t i = size_t(begin) * m_width; i < size_t(end) * m_width; ++i)
+            out[i] = (unsigned char)std::min(255.0f, std::sqrt(gx[i] * gx[i] + gy[i] * gy[i]) + 0.5f);
+    });
+    result->updatePixelData(out.data(), m_width, m_height, 1);
+    return result;
+}
+
+std::shared_ptr<Image> Image::detectEdges(float lowThreshold, float highThreshold, GradientOperator op) const {
+    auto result = std::make_shared<Image>();
+    if (m_pixels.empty()) return result;
+    const int w = m_width, h = m_height;
+    std::vector<float> gx, gy;
+    gradientXY(op, gx, gy);
+    std::vector<float> mag(gx.size());
+    for (size_t i = 0; i < mag.size(); ++i) mag[i] = std::sqrt(gx[i] * gx[i] + gy[i] * gy[i]);
+
+    // Non-maximum suppression along the gradient direction quantised to 45
+    // degrees: 0 = none, 1 = weak, 2 = strong
+    std::vector<unsigned char> state(mag.size(), 0);
+    const float tan22 = 0.41421356f;
+    parallelFor(h, [&](int begin, int end) {
+        for (int y = std::max(1, begin); y < std::min(h - 1, end); ++y)
+            for (int x = 1; x < w - 1; ++x) {
+                size_t i = size_t(y) * w + x;
+                float m = mag[i];
+                if (m < lowThreshold) continue;
+                float ax = std::fabs(gx[i]), ay = std::fabs(gy[i]);
+                ptrdiff_t step;
+                if (ay <= ax * tan22) step = 1;                                   // horizontal gradient
+                else if (ax <= ay * tan22) step = w;                              // vertical gradient
+                else step = (gx[i] > 0) == (gy[i] > 0) ? w + 1 : w - 1;           // diagonals
+                if (m > mag[i - step] && m >= mag[i + step]) state[i] = m >= highThreshold ? 2 : 1;
+            }
+    });
+
+    // Hysteresis: bands grow strong edges into connected weak pixels in
+    // parallel without crossing band borders. Strong pixels a band reaches on
+    // its first or last row are kept; a sequential step promotes their weak
+    // neighbours across the border and seeds only those into the next pass,
+    // so every pixel is flooded once however often a chain crosses borders.
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    int bandHeight = std::max(16, (h + threads - 1) / threads);
+    int bands = (h + bandHeight - 1) / bandHeight;
+    std::vector<std::vector<size_t>> seeds(bands), edges(bands);
+    parallelFor(bands, [&](int begin, int end) {
+        for (int band = begin; band < end; ++band) {
+            int y0 = band * bandHeight, y1 = std::min(h, y0 + bandHeight);
+            for (size_t i = size_t(y0) * w; i < size_t(y1) * w; ++i)
+                if (state[i] == 2) seeds[band].push_back(i);
+        }
+    });
+    for (bool pending = true; pending;) {
+        parallelFor(bands, [&](int begin, int end) {
+            for (int band = begin; band < end; ++band) {
+                int y0 = band * bandHeight, y1 = std::min(h, y0 + bandHeight);
+                std::vector<size_t>& stack = seeds[band];
+                while (!stack.empty()) {
+                    size_t i = stack.back();
+                    stack.pop_back();
+                    int y = int(i / w), x = int(i % w);
+                    if (y == y0 || y == y1 - 1) edges[band].push_back(i);
+                    for (int dy = -1; dy <= 1; ++dy)
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            int ny = y + dy, nx = x + dx;
+                            if (ny < y0 || ny >= y1 || nx < 0 || nx >= w) continue;
+                            size_t j = size_t(ny) * w + nx;
+                            if (state[j] == 1) {
+                                state[j] = 2;
+                                stack.push_back(j);
+                            }
+                        }
+                }
+            }
+        });
+        pending = false;
+        for (int band = 0; band < bands; ++band) {
+            int y0 = band * bandHeight, y1 = std::min(h, y0 + bandHeight);
+            for (size_t i : edges[band]) {
+                int y = int(i / w), x = int(i % w);
+                for (int ny : {y0 - 1, y1}) {
+                    if (ny < 0 || ny >= h || std::abs(ny - y) != 1) continue;
+                    for (int nx = std::max(0, x - 1); nx <= std::min(w - 1, x + 1); ++nx) {
+                        size_t j = size_t(ny) * w + nx;
+                        if (state[j] == 1) {
+                            state[j] = 2;
+                            seeds[ny / bandHeight].push_back(j);
+                            pending = true;
+                        }
+                    }
+                }
+            }
+            edges[band].clear();
+        }
+    }
+
+    for (auto& s : state) s = s == 2 ? 255 : 0;
+    result->updatePixelData(state.data(), w, h, 1);
+    return result;
+}
+
+int Image::labelComponents(std::vector<uint32_t>& labels, std::vector<ComponentStats>& stats,
+                           bool eightConnected) const {
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.labelComponents(labels, stats, eightConnected);
+    }
+    const int w = m_width, ch = m_channels;
+    const unsigned char* px = m_pixels.data();
+    return labelPixels(m_width, m_height, eightConnected,
+                       [=](int x, int y) {
+                           const unsigned char* p = px + (size_t(y) * w + x) * ch;
+                           return ch < 3 ? p[0] != 0 : (p[0] | p[1] | p[2]) != 0;
+                       },
+                       labels, stats);
+}
+
+bool Image::renderViewport(const Viewport& viewport, unsigned char* dst, int dstWidth, int dstHeight,
+                           size_t dstStride, int dstChannels) const {
+    if (m_pixels.empty() || !dst || dstWidth <= 0 || dstHeight <= 0 || viewport.zoom <= 0) return false;
+    if ((dstChannels != 3 && dstChannels != 4) || dstStride < size_t(dstWidth) * dstChannels) return false;
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.renderViewport(viewport, dst, dstWidth, dstHeight, dstStride, dstChannels);
+    }
+    renderBilinear(m_pixels.data(), m_width, m_height, m_channels, viewport.zoom, viewport.zoom, viewport.x,
+                   viewport.y, dst, dstWidth, dstHeight, dstStride, dstChannels);
+    return true;
+}
+
+Rect Image::smartCropRect(int width, int height) const {
+    if (m_pixels.empty() || width <= 0 || height <= 0) return Rect();
+    double aspect = double(width) / height;
+    Rect crop;
+    crop.width = std::min(m_width, std::max(1, int(m_height * aspect + 0.5)));
+    crop.height = std::min(m_height, std::max(1, int(crop.width / aspect + 0.5)));
+    bool slideX = crop.width < m_width;
+    if (crop.width == m_width && crop.height == m_height) return crop;
+
+    // Saliency on a preview of at most 128 px: local edge energy plus
+    // saturation, summed per column (or row) along the sliding axis
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.smartCropRect(width, height);
+    }
+    double shrink = std::min(1.0, 128.0 / std::max(m_width, m_height));
+    int pw = std::max(2, int(m_width * shrink)), ph = std::max(2, int(m_height * shrink));
+    std::vector<unsigned char> preview(size_t(pw) * ph * m_channels);
+    boxResample(m_pixels.data(), m_width, m_height, m_channels, preview.data(), pw, ph);
+    int lines = slideX ? pw : ph;
+    std::vector<double> profile(lines, 0.0);
+    for (int y = 0; y < ph; ++y)
+        for (int x = 0; x < pw; ++x) {
+            const unsigned char* p = &preview[(size_t(y) * pw + x) * m_channels];
+            const unsigned char* right = &preview[(size_t(y) * pw + std::min(pw - 1, x + 1)) * m_channels];
+            const unsigned char* down = &preview[(size_t(std::min(ph - 1, y + 1)) * pw + x) * m_channels];
+            int l = luma(p, m_channels);
+            double energy = std::abs(l - luma(right, m_channels)) + std::abs(l - luma(down, m_channels));
+            if (m_channels >= 3) {
+                int hi = std::max({p[0], p[1], p[2]}), lo = std::min({p[0], p[1], p[2]});
+                energy += 0.5 * (hi - lo);
+            }
+            profile[slideX ? x : y] += energy;
+        }
+
+    // Best window along the free axis; a slight centre bias breaks ties
+    int window = std::max(1, int((slideX ? crop.width : crop.height) * shrink + 0.5));
+    window = std::min(window, lines);
+    double sum = 0;
+    for (int i = 0; i < window; ++i) sum += profile[i];
+    double best = -1;
+    int bestStart = 0;
+    for (int start = 0; start + window <= lines; ++start) {
+        if (start > 0) sum += profile[start + window - 1] - profile[start - 1];
+        double offCentre = std::abs(start + window / 2.0 - lines / 2.0) / lines;
+        double score = sum * (1.0 - 0.1 * offCentre);
+        if (score > best) {
+            best = score;
+            bestStart = start;
+        }
+    }
+    if (slideX) crop.x = std::min(m_width - crop.width, int(bestStart / shrink + 0.5));
+    else crop.y = std::min(m_height - crop.height, int(bestStart / shrink + 0.5));
+    return crop;
+}
+
+std::shared_ptr<Image> Image::generateSmartThumbnail(int width, int height) {
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.generateSmartThumbnail(width, height);
+    }
+    auto thumb = std::make_shared<Image>();
+    Rect crop = smartCropRect(width, height);
+    if (crop.width <= 0) return thumb;
+    thumb->m_width = width;
+    thumb->m_height = height;
+    thumb->m_channels = m_channels;
+    thumb->m_pixels.resize(size_t(width) * height * m_channels);
+    resampleRegion(m_pixels.data(), m_width, m_channels, crop, thumb->m_pixels.data(), width, height);
+    return thumb;
+}
+
+Color Image::dominantColor() const {
+    auto colors = dominantColors(1);
+    return colors.empty() ? Color() : colors[0];
+}
+
+std::vector<Color> Image::dominantColors(int count) const {
+    if (m_pixels.empty() || count <= 0) return {};
+    int w, h;
+    auto preview = samplePreview(m_pixels.data(), m_width, m_height, channels(),
+                                 isIndexed() ? m_palette.data() : nullptr, 32, w, h);
+    return histogramColors(preview, count);
+}
+
+std::string Image::blurHash(int componentsX, int componentsY) const {
+    if (m_pixels.empty() || componentsX < 1 || componentsX > 9 || componentsY < 1 || componentsY > 9) return "";
+    int w, h;
+    auto preview = samplePreview(m_pixels.data(), m_width, m_height, channels(),
+                                 isIndexed() ? m_palette.data() : nullptr, 32, w, h);
+
+    // Separable cosine basis: factor(i, j) = sum cos(pi i x / w) cos(pi j y / h) * linear(x, y)
+    std::vector<float> cosX(size_t(componentsX) * w), cosY(size_t(componentsY) * h);
+    for (int i = 0; i < componentsX; ++i)
+        for (int x = 0; x < w; ++x) cosX[size_t(i) * w + x] = float(std::cos(3.14159265358979 * i * x / w));
+    for (int j = 0; j < componentsY; ++j)
+        for (int y = 0; y < h; ++y) cosY[size_t(j) * h + y] = float(std::cos(3.14159265358979 * j * y / h));
+    std::vector<float> linear(preview.size());
+    for (size_t i = 0; i < preview.size(); ++i) linear[i] = srgbToLinear(preview[i]);
+
+    std::vector<float> factors(size_t(componentsX) * componentsY * 3, 0.0f);
+    std::vector<float> rowSums(size_t(componentsX) * 3);
+    for (int y = 0; y < h; ++y) {
+        std::fill(rowSums.begin(), rowSums.end(), 0.0f);
+        const float* row = &linear[size_t(y) * w * 3];
+        for (int i = 0; i < componentsX; ++i)
+            for (int x = 0; x < w; ++x)
+                for (int c = 0; c < 3; ++c) rowSums[i * 3 + c] += cosX[size_t(i) * w + x] * row[x * 3 + c];
+        for (int j = 0; j < componentsY; ++j)
+            for (int i = 0; i < componentsX; ++i)
+                for (int c = 0; c < 3; ++c)
+                    factors[(size_t(j) * componentsX + i) * 3 + c] += cosY[size_t(j) * h + y] * rowSums[i * 3 + c];
+    }
+    for (size_t k = 0; k < factors.size(); ++k) factors[k] *= (k < 3 ? 1.0f : 2.0f) / float(w * h);
+
+    std::string hash;
+    appendBase83(hash, (componentsX - 1) + (componentsY - 1) * 9, 1);
+    float maxAc = 0;
+    for (size_t k = 3; k < factors.size(); ++k) maxAc = std::max(maxAc, std::fabs(factors[k]));
+    float maxValue = 1;
+    if (factors.size() > 3) {
+        int quantised = std::min(82, std::max(0, int(std::floor(maxAc * 166 - 0.5f))));
+        maxValue = (quantised + 1) / 166.0f;
+        appendBase83(hash, quantised, 1);
+    } else {
+        appendBase83(hash, 0, 1);
+    }
+    appendBase83(hash, linearToSrgb(factors[0]) << 16 | linearToSrgb(factors[1]) << 8 | linearToSrgb(factors[2]), 4);
+    for (size_t k = 3; k < factors.size(); k += 3) {
+        int q[3];
+        for (int c = 0; c < 3; ++c) {
+            float v = factors[k + c] / maxValue;
+            float signPow = std::copysign(std::sqrt(std::fabs(v)), v);
+            q[c] = std::min(18, std::max(0, int(std::floor(signPow * 9 + 9.5f))));
+        }
+        appendBase83(hash, q[0] * 19 * 19 + q[1] * 19 + q[2], 2);
+    }
+    return hash;
+}
+
+std::string Image::lqipDataUri(int maxSize, int quality) const {
+    if (m_pixels.empty() || maxSize <= 0) return "";
+    int w, h;
+    auto preview = samplePreview(m_pixels.data(), m_width, m_height, channels(),
+                                 isIndexed() ? m_palette.data() : nullptr, maxSize, w, h);
+    std::vector<unsigned char> jpeg;
+    if (!stbi_write_jpg_to_func(appendToVector, &jpeg, w, h, 3, preview.data(), quality)) return "";
+    std::string uri = "data:image/jpeg;base64,";
+    appendBase64(uri, jpeg);
+    return uri;
+}
+
+std::vector<uint64_t> Image::tileHashes(int tileSize) const {
+    if (m_pixels.empty() || tileSize <= 0) return {};
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.tileHashes(tileSize);
+    }
+    int tilesX = (m_width + tileSize - 1) / tileSize;
+    int tilesY = (m_height + tileSize - 1) / tileSize;
+    std::vector<uint64_t> hashes(size_t(tilesX) * tilesY);
+    size_t stride = size_t(m_width) * m_channels;
+    // Every hash is seeded with the image shape, so a resize or channel
+    // change dirties all tiles even when the tile count is unchanged
+    const int32_t shape[3] = {m_width, m_height, m_channels};
+    const uint64_t seed = xxHash64(reinterpret_cast<const unsigned char*>(shape), sizeof(shape));
+    parallelFor(tilesY, [&](int begin, int end) {
+        std::vector<unsigned char> tile(size_t(tileSize) * tileSize * m_channels);
+        for (int ty = begin; ty < end; ++ty) {
+            int y0 = ty * tileSize, rows = std::min(tileSize, m_height - y0);
+            for (int tx = 0; tx < tilesX; ++tx) {
+                int x0 = tx * tileSize;
+                size_t rowBytes = size_t(std::min(tileSize, m_width - x0)) * m_channels;
+                for (int y = 0; y < rows; ++y)
+                    std::memcpy(&tile[y * rowBytes], &m_pixels[(y0 + y) * stride + size_t(x0) * m_channels], rowBytes);
+                hashes[size_t(ty) * tilesX + tx] = xxHash64(tile.data(), rowBytes * rows) ^ seed;
+            }
+        }
+    });
+    return hashes;
+}
+
+std::vector<Rect> Image::changedTiles(const std::vector<uint64_t>& previousHashes, int tileSize) const {
+    auto hashes = tileHashes(tileSize);
+    if (hashes.empty()) return {};
+    // A different tile count means the image was resized; same-count shape
+    // changes differ in every hash through the seed
+    if (hashes.size() != previousHashes.size()) return {Rect{0, 0, m_width, m_height}};
+    std::vector<char> dirty(hashes.size());
+    for (size_t i = 0; i < hashes.size(); ++i) dirty[i] = hashes[i] != previousHashes[i];
+    return dirtyRuns(dirty, m_width, m_height, tileSize);
+}
+
+std::vector<Rect> Image::diffTiles(const Image& other, int tileSize) const {
+    if (m_pixels.empty() || tileSize <= 0) return {};
+    if (isIndexed() || other.isIndexed()) {
+        Image a(*this), b(other);
+        a.expandPalette();
+        b.expandPalette();
+        return a.diffTiles(b, tileSize);
+    }
+    if (other.m_width != m_width || other.m_height != m_height || other.m_channels != m_channels)
+        return {Rect{0, 0, m_width, m_height}};
+    int tilesX = (m_width + tileSize - 1) / tileSize;
+    int tilesY = (m_height + tileSize - 1) / tileSize;
+    std::vector<char> dirty(size_t(tilesX) * tilesY, 0);
+    size_t stride = size_t(m_width) * m_channels;
+    // Row by row over a tile row: memcmp is vectorised by the C library, and a
+    // tile stops being compared as soon as it is known to be dirty
+    parallelFor(tilesY, [&](int begin, int end) {
+        for (int ty = begin; ty < end; ++ty) {
+            char* flags = &dirty[size_t(ty) * tilesX];
+            int y0 = ty * tileSize, y1 = std::min(m_height, y0 + tileSize);
+            for (int y = y0; y < y1; ++y) {
+                const unsigned char* a = &m_pixels[y * stride];
+                const unsigned char* b = &other.m_pixels[y * stride];
+                if (std::memcmp(a, b, stride) == 0) continue;
+                for (int tx = 0; tx < tilesX; ++tx) {
+                    if (flags[tx]) continue;
+                    size_t offset = size_t(tx) * tileSize * m_channels;
+                    size_t bytes = size_t(std::min(tileSize, m_width - tx * tileSize)) * m_channels;
+                    flags[tx] = std::memcmp(a + offset, b + offset, bytes) != 0;
+                }
+            }
+        }
+    });
+    return dirtyRuns(dirty, m_width, m_height, tileSize);
+}
+
+std::shared_ptr<Image> Image::diffImage(const Image& other) const {
+    if (m_pixels.empty() || other.m_width != m_width || other.m_height != m_height) return nullptr;
+    if (isIndexed() || other.isIndexed()) {
+        Image a(*this), b(other);
+        a.expandPalette();
+        b.expandPalette();
+        return a.diffImage(b);
+    }
+    if (other.m_channels != m_channels) return nullptr;
+    auto diff = std::make_shared<Image>();
+    diff->m_width = m_width;
+    diff->m_height = m_height;
+    diff->m_channels = m_channels;
+    diff->m_pixels.resize(m_pixels.size());
+    size_t stride = size_t(m_width) * m_channels;
+    parallelFor(m_height, [&](int begin, int end) {
+        for (size_t i = begin * stride; i < end * stride; ++i) {
+            int d = int(m_pixels[i]) - int(other.m_pixels[i]);
+            diff->m_pixels[i] = (unsigned char)(d < 0 ? -d : d);
+        }
+    });
+    return diff;
+}
+
+uint64_t Image::perceptualHash(HashType type) const {
+    if (m_pixels.empty()) return 0;
+    if (isIndexed()) {
+        Image expanded(*this);
+        expanded.expandPalette();
+        return expanded.perceptualHash(type);
+    }
+    uint64_t hash = 0;
+    switch (type) {
+        case HashType::Average: {
+            auto gray = grayThumbnail(m_pixels.data(), m_width, m_height, m_channels, 8, 8);
+            unsigned sum = 0;
+            for (auto v : gray) sum += v;
+            for (int i = 0; i < 64; ++i)
+                if (gray[i] * 64u > sum) hash |= uint64_t(1) << i;
+            break;
+        }
+        case HashType::Difference: {
+            auto gray = grayThumbnail(m_pixels.data(), m_width, m_height, m_channels, 9, 8);
+            for (int y = 0; y < 8; ++y)
+                for (int x = 0; x < 8; ++x)
+                    if (gray[y * 9 + x] > gray[y * 9 + x + 1]) hash |= uint64_t(1) << (y * 8 + x);
+            break;
+        }
+        case HashType::Perceptual: {
+            // 32x32 DCT-II, keep the 8x8 lowest frequencies, threshold at the median
+            auto gray = grayThumbnail(m_pixels.data(), m_width, m_height, m_channels, 32, 32);
+            static const auto cosTable = [] {
+                std::vector<float> t(8 * 32);
+                for (int u = 0; u < 8; ++u)
+                    for (int x = 0; x < 32; ++x)
+                        t[u * 32 + x] = float(std::cos((2 * x + 1) * u * 3.14159265358979 / 64));
+                return t;
+            }();
+            float rows[32 * 8];
+            for (int y = 0; y < 32; ++y)
+                for (int u = 0; u < 8; ++u) {
+                    float acc = 0;
+                    for (int x = 0; x < 32; ++x) acc += gray[y * 32 + x] * cosTable[u * 32 + x];
+                    rows[y * 8 + u] = acc;
+                }
+            float coeffs[64];
+            for (int v = 0; v < 8; ++v)
+                for (int u = 0; u < 8; ++u) {
+                    float acc = 0;
+                    for (int y = 0; y < 32; ++y) acc += rows[y * 8 + u] * cosTable[v * 32 + y];
+                    coeffs[v * 8 + u] = acc;
+                }
+            float sorted[63];
+            std::copy(coeffs + 1, coeffs + 64, sorted); // DC term excluded from the median
+            std::nth_element(sorted, sorted + 31, sorted + 63);
+            float median = sorted[31];
+            for (int i = 0; i < 64; ++i)
+                if (coeffs[i] > median) hash |= uint64_t(1) << i;
+            break;
+        }
+    }
+    return hash;
+}
+
+std::string Image::getMetadata(const std::string& key) const {
+    // TODO: Implement EXIF parsing if needed
+    return "";
+}
+
+// ==================== BITIMAGE ====================
+BitImage::BitImage(int width, int height)
+    : m_width(std::max(0, width)), m_height(std::max(0, height)),
+      m_stride(size_t((m_width + 63) / 64) * 8), m_bits(m_stride * m_height, 0) {}
+
+std::shared_ptr<BitImage> BitImage::fromImage(const Image& image, int threshold) {
+    if (image.isIndexed()) {
+        Image expanded(image);
+        expanded.expandPalette();
+        return fromImage(expanded, threshold);
+    }
+    auto bits = std::make_shared<BitImage>(image.m_width, image.m_height);
+    int channels = image.m_channels;
+    parallelFor(image.m_height, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            const unsigned char* src = &image.m_pixels[size_t(y) * image.m_width * channels];
+            unsigned char* dst = &bits->m_bits[y * bits->m_stride];
+            for (int x = 0; x < image.m_width; ++x)
+                if (luma(src + size_t(x) * channels, channels) > threshold) dst[x >> 3] |= 0x80 >> (x & 7);
+        }
+    });
+    return bits;
+}
+
+std::shared_ptr<BitImage> BitImage::binarize(const Image& image, ThresholdMethod method, int window, float k) {
+    if (image.isIndexed()) {
+        Image expanded(image);
+        expanded.expandPalette();
+        return binarize(expanded, method, window, k);
+    }
+    auto bits = std::make_shared<BitImage>(image.m_width, image.m_height);
+    if (image.m_pixels.empty()) return bits;
+    std::vector<unsigned char> converted;
+    const unsigned char* gray = image.m_pixels.data();
+    if (image.m_channels != 1) {
+        converted = grayPlane(image.m_pixels.data(), image.m_width, image.m_height, image.m_channels);
+        gray = converted.data();
+    }
+    thresholdRows(gray, image.m_width, image.m_height, method, window, k,
+                  [&](int y, const unsigned char* mask) {
+                      unsigned char* dst = &bits->m_bits[y * bits->m_stride];
+                      for (int x = 0; x < image.m_width; x += 8) {
+                          unsigned char b = 0;
+                          for (int i = 0; i < 8 && x + i < image.m_width; ++i) b |= mask[x + i] << (7 - i);
+                          dst[x >> 3] = b;
+                      }
+                  });
+    return bits;
+}
+
+std::shared_ptr<Image> BitImage::toImage() const {
+    auto img = std::make_shared<Image>();
+    img->m_width = m_width;
+    img->m_height = m_height;
+    img->m_channels = 1;
+    img->m_pixels.resize(size_t(m_width) * m_height);
+    parallelFor(m_height, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            const unsigned char* src = &m_bits[y * m_stride];
+            unsigned char* dst = &img->m_pixels[size_t(y) * m_width];
+            for (int x = 0; x < m_width; ++x) dst[x] = (src[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0;
+        }
+    });
+    return img;
+}
+
+int BitImage::width() const { return m_width; }
+int BitImage::height() const { return m_height; }
+size_t BitImage::stride() const { return m_stride; }
+const unsigned char* BitImage::data() const { return m_bits.data(); }
+unsigned char* BitImage::data() { return m_bits.data(); }
+
+bool BitImage::get(int x, int y) const {
+    if (x < 0 || y < 0 || x >= m_width || y >= m_height) return false;
+    return (m_bits[y * m_stride + (x >> 3)] & (0x80 >> (x & 7))) != 0;
+}
+
+void BitImage::set(int x, int y, bool white) {
+    if (x < 0 || y < 0 || x >= m_width || y >= m_height) return;
+    unsigned char& b = m_bits[y * m_stride + (x >> 3)];
+    if (white) b |= 0x80 >> (x & 7);
+    else b &= ~(0x80 >> (x & 7));
+}
+
+void BitImage::clearPadding() {
+    if (m_width % 8 == 0 && size_t(m_width / 8) == m_stride) return;
+    size_t used = size_t(m_width) / 8;
+    unsigned char mask = (unsigned char)(0xFF << (8 - m_width % 8));
+    for (int y = 0; y < m_height; ++y) {
+        unsigned char* row = &m_bits[y * m_stride];
+        size_t from = used;
+        if (m_width % 8) row[from++] &= mask;
+        std::fill(row + from, row + m_stride, 0);
+    }
+}
+
+void BitImage::transpose() {
+    // 8x8 bit blocks: source rows y..y+7 at byte column bx become
+    // destination rows 8*bx..8*bx+7 at byte column y/8
+    BitImage dst(m_height, m_width);
+    int blockRows = (m_height + 7) / 8;
+    int blockCols = (m_width + 7) / 8;
+    parallelFor(blockCols, [&](int begin, int end) {
+        for (int bx = begin; bx < end; ++bx)
+            for (int by = 0; by < blockRows; ++by) {
+                uint64_t block = 0;
+                for (int r = 0; r < 8; ++r) {
+                    int y = by * 8 + r;
+                    unsigned char b = y < m_height ? m_bits[y * m_stride + bx] : 0;
+                    block |= uint64_t(b) << (56 - 8 * r);
+                }
+                block = transpose8(block);
+                for (int r = 0; r < 8; ++r) {
+                    int y = bx * 8 + r;
+                    if (y < dst.m_height) dst.m_bits[y * dst.m_stride + by] = (unsigned char)(block >> (56 - 8 * r));
+                }
+            }
+    });
+    *this = std::move(dst);
+    clearPadding();
+}
+
+void BitImage::flipHorizontal() {
+    size_t used = size_t(m_width + 7) / 8;
+    int pad = int(used * 8) - m_width;
+    std::vector<unsigned char> row(used);
+    for (int y = 0; y < m_height; ++y) {
+        unsigned char* bits = &m_bits[y * m_stride];
+        for (size_t i = 0; i < used; ++i) row[i] = reverseBits(bits[used - 1 - i]);
+        // Reversal moves the padding bits to the front; shift them back out
+        copyBits(row.data(), size_t(pad), bits, size_t(m_width));
+    }
+    clearPadding();
+}
+
+void BitImage::flipVertical() {
+    for (int y = 0; y < m_height / 2; ++y)
+        std::swap_ranges(m_bits.begin() + y * m_stride, m_bits.begin() + (y + 1) * m_stride,
+                         m_bits.begin() + (m_height - 1 - y) * m_stride);
+}
+
+void BitImage::rotateClockwise() {
+    transpose();
+    flipHorizontal();
+}
+
+void BitImage::rotateCounterClockwise() {
+    transpose();
+    flipVertical();
+}
+
+bool BitImage::crop(int x, int y, int width, int height) {
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > m_width || y + height > m_height)
+        return false;
+    BitImage dst(width, height);
+    for (int row = 0; row < height; ++row)
+        copyBits(&m_bits[(y + row) * m_stride], size_t(x), &dst.m_bits[row * dst.m_stride], size_t(width));
+    *this = std::move(dst);
+    return true;
+}
+
+std::shared_ptr<Image> BitImage::scaleToGray(int factor) const {
+    if (factor < 1) return nullptr;
+    int w = m_width / factor, h = m_height / factor;
+    if (w == 0 || h == 0) return nullptr;
+    auto img = std::make_shared<Image>();
+    img->m_width = w;
+    img->m_height = h;
+    img->m_channels = 1;
+    img->m_pixels.resize(size_t(w) * h);
+    int area = factor * factor;
+    parallelFor(h, [&](int begin, int end) {
+        std::vector<int> counts(w);
+        for (int oy = begin; oy < end; ++oy) {
+            std::fill(counts.begin(), counts.end(), 0);
+            for (int y = oy * factor; y < (oy + 1) * factor; ++y) {
+                const unsigned char* row = &m_bits[y * m_stride];
+                if (8 % factor == 0) {
+                    // Whole groups per byte: mask each group and popcount it
+                    int groups = 8 / factor;
+                    unsigned char mask = (unsigned char)(0xFF << (8 - factor));
+                    for (int x = 0; x < w; x += groups) {
+                        unsigned char b = row[(x * factor) >> 3];
+                        for (int g = 0; g < groups && x + g < w; ++g)
+                            counts[x + g] += popcount8(b & (mask >> (g * factor)));
+                    }
+                } else if (factor % 8 == 0) {
+                    for (int x = 0; x < w; ++x)
+                        for (int i = 0; i < factor / 8; ++i) counts[x] += popcount8(row[x * factor / 8 + i]);
+                } else {
+                    for (int x = 0; x < w * factor; ++x)
+                        if (row[x >> 3] & (0x80 >> (x & 7))) ++counts[x / factor];
+                }
+            }
+            unsigned char* dst = &img->m_pixels[size_t(oy) * w];
+            for (int x = 0; x < w; ++x) dst[x] = (unsigned char)((counts[x] * 255 + area / 2) / area);
+        }
+    });
+    return img;
+}
+
+void BitImage::erodeOrDilate(bool erode, int kernelWidth, int kernelHeight) {
+    int words = int(m_stride / 8);
+    uint64_t identity = erode ? ~uint64_t(0) : 0;
+    std::vector<uint64_t> packed(size_t(words) * m_height);
+    for (size_t i = 0; i < packed.size(); ++i) packed[i] = loadWordBE(&m_bits[i * 8]);
+
+    if (kernelWidth > 1) {
+        // Shift each row right by k/2 into a buffer with identity margin words,
+        // then build runs of k bits by doubling (acc holds runs of m bits,
+        // result runs of `covered` bits, both looking ahead)
+        int left = kernelWidth / 2;
+        int tail = m_width % 64;
+        int wide = words + (kernelWidth + 63) / 64 + 1;
+        parallelFor(m_height, [&](int begin, int end) {
+            std::vector<uint64_t> line(wide), acc(wide), shifted(wide), result(wide);
+            for (int y = begin; y < end; ++y) {
+                uint64_t* row = &packed[size_t(y) * words];
+                if (erode && tail) row[words - 1] |= ~uint64_t(0) >> tail; // padding must not erode
+                std::copy(row, row + words, line.begin());
+                std::fill(line.begin() + words, line.end(), identity);
+                shiftBits(line.data(), acc.data(), wide, -left, identity);
+                int covered = 0;
+                for (int m = 1, k = kernelWidth; k; m *= 2, k >>= 1) {
+                    if (k & 1) {
+                        if (covered == 0) {
+                            result = acc;
+                        } else {
+                            shiftBits(acc.data(), shifted.data(), wide, covered, identity);
+                            for (int i = 0; i < wide; ++i)
+                                result[i] = erode ? result[i] & shifted[i] : result[i] | shifted[i];
+                        }
+                        covered += m;
+                    }
+                    if (k > 1) {
+                        shiftBits(acc.data(), shifted.data(), wide, m, identity);
+                        for (int i = 0; i < wide; ++i) acc[i] = erode ? acc[i] & shifted[i] : acc[i] | shifted[i];
+                    }
+                }
+                std::copy(result.begin(), result.begin() + words, row);
+            }
+        });
+    }
+    if (erode) vanHerkColumns(packed.data(), size_t(words), m_height, kernelHeight, identity,
+                              [](uint64_t a, uint64_t b) { return a & b; });
+    else vanHerkColumns(packed.data(), size_t(words), m_height, kernelHeight, identity,
+                        [](uint64_t a, uint64_t b) { return a | b; });
+
+    for (size_t i = 0; i < packed.size(); ++i) storeWordBE(&m_bits[i * 8], packed[i]);
+    clearPadding();
+}
+
+void BitImage::morphology(MorphOp op, int kernelWidth, int kernelHeight) {
+    if (m_bits.empty() || kernelWidth < 1 || kernelHeight < 1) return;
+    switch (op) {
+        case MorphOp::Erode:
+            erodeOrDilate(true, kernelWidth, kernelHeight);
+            break;
+        case MorphOp::Dilate:
+            erodeOrDilate(false, kernelWidth, kernelHeight);
+            break;
+        case MorphOp::Open:
+            erodeOrDilate(true, kernelWidth, kernelHeight);
+            erodeOrDilate(false, kernelWidth, kernelHeight);
+            break;
+        case MorphOp::Close:
+            erodeOrDilate(false, kernelWidth, kernelHeight);
+            erodeOrDilate(true, kernelWidth, kernelHeight);
+            break;
+    }
+}
+
+int BitImage::labelComponents(std::vector<uint32_t>& labels, std::vector<ComponentStats>& stats,
+                              bool eightConnected) const {
+    const unsigned char* bits = m_bits.data();
+    const size_t stride = m_stride;
+    return labelPixels(m_width, m_height, eightConnected,
+                       [=](int x, int y) { return (bits[y * stride + (x >> 3)] & (0x80 >> (x & 7))) != 0; },
+                       labels, stats);
+}
+
+bool BitImage::saveAs(const std::string& path, ImageFormat format) const {
+    if (m_bits.empty()) return false;
+    size_t rowBytes = size_t(m_width + 7) / 8;
+    std::vector<unsigned char> out;
+    if (format == ImageFormat::PNG) {
+        // Gray, bit depth 1: filter byte 0 then the packed row, deflated by stb
+        std::vector<unsigned char> raw((rowBytes + 1) * m_height);
+        for (int y = 0; y < m_height; ++y) {
+            raw[y * (rowBytes + 1)] = 0;
+            std::memcpy(&raw[y * (rowBytes + 1) + 1], &m_bits[y * m_stride], rowBytes);
+        }
+        int zlen = 0;
+        unsigned char* z = stbi_zlib_compress(raw.data(), int(raw.size()), &zlen, stbi_write_png_compression_level);
+        if (!z) return false;
+        auto chunk = [&](const char* type, const unsigned char* payload, size_t len) {
+            unsigned char head[8];
+            writeBE32(head, uint32_t(len));
+            std::memcpy(head + 4, type, 4);
+            out.insert(out.end(), head, head + 8);
+            out.insert(out.end(), payload, payload + len);
+            unsigned char crc[4];
+            writeBE32(crc, crc32(payload, len, crc32(head + 4, 4)));
+            out.insert(out.end(), crc, crc + 4);
+        };
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        out.assign(signature, signature + 8);
+        unsigned char ihdr[13] = {};
+        writeBE32(ihdr, uint32_t(m_width));
+        writeBE32(ihdr + 4, uint32_t(m_height));
+        ihdr[8] = 1; // bit depth
+        ihdr[9] = 0; // grayscale
+        chunk("IHDR", ihdr, sizeof(ihdr));
+        chunk("IDAT", z, size_t(zlen));
+        chunk("IEND", nullptr, 0);
+        STBIW_FREE(z);
+    } else if (format == ImageFormat::TIFF) {
+        // Little-endian baseline bilevel TIFF, one PackBits strip
+        std::vector<unsigned char> strip;
+        for (int y = 0; y < m_height; ++y) packBits(&m_bits[y * m_stride], rowBytes, strip);
+        auto put16 = [&](uint16_t v) { out.push_back(v & 0xff); out.push_back(v >> 8); };
+        auto put32 = [&](uint32_t v) { put16(uint16_t(v & 0xffff)); put16(uint16_t(v >> 16)); };
+        const uint16_t entries = 8;
+        uint32_t ifdOffset = 8;
+        uint32_t stripOffset = ifdOffset + 2 + entries * 12 + 4;
+        out.insert(out.end(), {'I', 'I', 42, 0});
+        put32(ifdOffset);
+        put16(entries);
+        auto tag = [&](uint16_t id, uint16_t type, uint32_t value) {
+            put16(id);
+            put16(type);
+            put32(1);
+            if (type == 3) { put16(uint16_t(value)); put16(0); } else { put32(value); }
+        };
+        tag(256, 4, uint32_t(m_width));        // ImageWidth
+        tag(257, 4, uint32_t(m_height));       // ImageLength
+        tag(258, 3, 1);                        // BitsPerSample
+        tag(259, 3, 32773);                    // Compression: PackBits
+        tag(262, 3, 1);                        // PhotometricInterpretation: BlackIsZero
+        tag(273, 4, stripOffset);              // StripOffsets
+        tag(278, 4, uint32_t(m_height));       // RowsPerStrip
+        tag(279, 4, uint32_t(strip.size()));   // StripByteCounts
+        put32(0);                              // no further IFDs
+        out.insert(out.end(), strip.begin(), strip.end());
+    } else {
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary);
+    return bool(file.write(reinterpret_cast<const char*>(out.data()), out.size()));
+}
+
+// ==================== IMAGE PYRAMID ====================
+std::shared_ptr<ImagePyramid> ImagePyramid::build(const Image& image, int minSize) {
+    if (image.m_pixels.empty()) return nullptr;
+    auto pyramid = std::make_shared<ImagePyramid>();
+    pyramid->m_levels.push_back(image);
+    pyramid->m_levels.back().expandPalette();
+    for (;;) {
+        const Image& prev = pyramid->m_levels.back();
+        if (std::min(prev.m_width, prev.m_height) / 2 < std::max(1, minSize)) break;
+        Image next;
+        next.m_width = prev.m_width / 2;
+        next.m_height = prev.m_height / 2;
+        next.m_channels = prev.m_channels;
+        next.m_pixels.resize(size_t(next.m_width) * next.m_height * next.m_channels);
+        boxResample(prev.m_pixels.data(), prev.m_width, prev.m_height, prev.m_channels, next.m_pixels.data(),
+                    next.m_width, next.m_height);
+        pyramid->m_levels.push_back(std::move(next));
+    }
+    return pyramid;
+}
+
+size_t ImagePyramid::levels() const { return m_levels.size(); }
+const Image& ImagePyramid::level(size_t index) const { return m_levels[index]; }
+int ImagePyramid::width() const { return m_levels.empty() ? 0 : m_levels[0].m_width; }
+int ImagePyramid::height() const { return m_levels.empty() ? 0 : m_levels[0].m_height; }
+
+bool ImagePyramid::render(const Viewport& viewport, unsigned char* dst, int dstWidth, int dstHeight,
+                          size_t dstStride, int dstChannels) const {
+    if (m_levels.empty() || viewport.zoom <= 0) return false;
+    if ((dstChannels != 3 && dstChannels != 4) || !dst || dstWidth <= 0 || dstHeight <= 0 ||
+        dstStride < size_t(dstWidth) * dstChannels)
+        return false;
+    // Smallest level that still has at least one pixel per output pixel
+    size_t index = 0;
+    while (index + 1 < m_levels.size() && double(m_levels[index + 1].m_width) / width() >= viewport.zoom) ++index;
+    const Image& level = m_levels[index];
+    // Level coordinates: pan and zoom scaled by the level's actual size ratio
+    double sx = double(level.m_width) / width();
+    double sy = double(level.m_height) / height();
+    renderBilinear(level.m_pixels.data(), level.m_width, level.m_height, level.m_channels, viewport.zoom / sx,
+                   viewport.zoom / sy, viewport.x * sx, viewport.y * sy, dst, dstWidth, dstHeight, dstStride,
+                   dstChannels);
+    return true;
+}
+
+// ==================== TILEDIMAGE ====================
+std::shared_ptr<TiledImage> TiledImage::fromImage(const Image& image, int tileSize) {
+    if (image.m_pixels.empty() || tileSize <= 0) return nullptr;
+    if (image.isIndexed()) {
+        Image expanded(image);
+        expanded.expandPalette();
+        return fromImage(expanded, tileSize);
+    }
+    auto tiled = std::make_shared<TiledImage>();
+    tiled->allocate(image.m_width, image.m_height, image.m_channels, tileSize);
+    size_t stride = size_t(image.m_width) * image.m_channels;
+    parallelFor(tiled->m_tilesY, [&](int begin, int end) {
+        for (int ty = begin; ty < end; ++ty) {
+            int rows = std::min(tileSize, image.m_height - ty * tileSize);
+            for (int tx = 0; tx < tiled->m_tilesX; ++tx) {
+                unsigned char* dst = tiled->tile(tx, ty);
+                const unsigned char* src = &image.m_pixels[size_t(ty) * tileSize * stride +
+                                                           size_t(tx) * tileSize * image.m_channels];
+                size_t rowBytes = size_t(std::min(tileSize, image.m_width - tx * tileSize)) * image.m_channels;
+                for (int y = 0; y < rows; ++y)
+                    std::memcpy(dst + size_t(y) * tileSize * image.m_channels, src + y * stride, rowBytes);
+            }
+        }
+    });
+    return tiled;
+}
+
+std::shared_ptr<Image> TiledImage::toImage() const {
+    auto img = std::make_shared<Image>();
+    if (m_tiles.empty()) return img;
+    img->m_width = m_width;
+    img->m_height = m_height;
+    img->m_channels = m_channels;
+    img->m_pixels.resize(size_t(m_width) * m_height * m_channels);
+    size_t stride = size_t(m_width) * m_channels;
+    parallelFor(m_tilesY, [&](int begin, int end) {
+        for (int ty = begin; ty < end; ++ty) {
+            int rows = std::min(m_tileSize, m_height - ty * m_tileSize);
+            for (int tx = 0; tx < m_tilesX; ++tx) {
+                const unsigned char* src = tile(tx, ty);
+                unsigned char* dst = &img->m_pixels[size_t(ty) * m_tileSize * stride + size_t(tx) * m_tileSize * m_channels];
+                size_t rowBytes = size_t(std::min(m_tileSize, m_width - tx * m_tileSize)) * m_channels;
+                for (int y = 0; y < rows; ++y)
+                    std::memcpy(dst + y * stride, src + size_t(y) * m_tileSize * m_channels, rowBytes);
+            }
+        }
+    });
+    return img;
+}
+
+int TiledImage::width() const { return m_width; }
+int TiledImage::height() const { return m_height; }
+int TiledImage::channels() const { return m_channels; }
+int TiledImage::tileSize() const { return m_tileSize; }
+int TiledImage::tilesX() const { return m_tilesX; }
+int TiledImage::tilesY() const { return m_tilesY; }
+
+size_t TiledImage::tileBytes() const { return size_t(m_tileSize) * m_tileSize * m_channels; }
+
+const unsigned char* TiledImage::tile(int tileX, int tileY) const {
+    return &m_tiles[(size_t(tileY) * m_tilesX + tileX) * tileBytes()];
+}
+
+unsigned char* TiledImage::tile(int tileX, int tileY) {
+    return &m_tiles[(size_t(tileY) * m_tilesX + tileX) * tileBytes()];
+}
+
+const unsigned char* TiledImage::pixel(int x, int y) const {
+    return tile(x / m_tileSize, y / m_tileSize) +
+           (size_t(y % m_tileSize) * m_tileSize + x % m_tileSize) * m_channels;
+}
+
+void TiledImage::allocate(int width, int height, int channels, int tileSize) {
+    m_width = width;
+    m_height = height;
+    m_channels = channels;
+    m_tileSize = tileSize;
+    m_tilesX = (width + tileSize - 1) / tileSize;
+    m_tilesY = (height + tileSize - 1) / tileSize;
+    m_tiles.assign(size_t(m_tilesX) * m_tilesY * tileBytes(), 0);
+}
+
+void TiledImage::rotate(bool clockwise) {
+    if (m_tiles.empty()) return;
+    TiledImage out;
+    out.allocate(m_height, m_width, m_channels, m_tileSize);
+    const int ts = m_tileSize, w = m_width, h = m_height;
+    const ptrdiff_t ch = m_channels;
+    PixelRunFn copyRun = kPixelRuns[m_channels - 1];
+    // Output column x is source row h - 1 - x (clockwise) or x, read left to
+    // right (clockwise) or right to left. Each output tile copies whole runs
+    // of that row from the one or two source tiles the span crosses.
+    parallelFor(out.m_tilesX * out.m_tilesY, [&](int begin, int end) {
+        for (int t = begin; t < end; ++t) {
+            int tx = t % out.m_tilesX, ty = t / out.m_tilesX;
+            unsigned char* dst = out.tile(tx, ty);
+            int rows = std::min(ts, out.m_height - ty * ts);
+            int cols = std::min(ts, out.m_width - tx * ts);
+            for (int x = 0; x < cols; ++x) {
+                int sy = clockwise ? h - 1 - (tx * ts + x) : tx * ts + x;
+                const unsigned char* srcRow = tile(0, sy / ts) + size_t(sy % ts) * ts * ch;
+                for (int y = 0; y < rows;) {
+                    int sx = clockwise ? ty * ts + y : w - 1 - (ty * ts + y);
+                    int inTile = sx % ts;
+                    int run = std::min(rows - y, clockwise ? ts - inTile : inTile + 1);
+                    copyRun(srcRow + ((sx / ts) * tileBytes() + inTile * ch), clockwise ? ch : -ch,
+                            dst + (size_t(y) * ts + x) * ch, ts * ch, run);
+                    y += run;
+                }
+            }
+        }
+    });
+    *this = std::move(out);
+}
+
+void TiledImage::rotateClockwise() { rotate(true); }
+
+void TiledImage::rotateCounterClockwise() { rotate(false); }
+
+void TiledImage::scale(float factor) {
+    if (m_tiles.empty() || factor <= 0) return;
+    const int sw = m_width, sh = m_height, ts = m_tileSize, ch = m_channels;
+    const int dw = std::max(1, int(sw * factor)), dh = std::max(1, int(sh * factor));
+    TiledImage out;
+    out.allocate(dw, dh, ch, ts);
+    const unsigned char* base = m_tiles.data();
+    parallelFor(out.m_tilesX * out.m_tilesY, [&](int begin, int end) {
+        // Per output tile: the source span of every column and row, plus the
+        // byte offset of each source column and row those spans cover, so the
+        // averaging loop does no tile arithmetic
+        std::vector<int> xs(ts + 1), ys(ts + 1);
+        std::vector<size_t> colOffset, rowOffset;
+        auto spans = [](std::vector<int>& s, int first, int count, int src, int dst) {
+            for (int i = 0; i <= count; ++i) s[i] = int(int64_t(first + i) * src / dst);
+            return std::max(s[count - 1] + 1, s[count]); // end of the last span
+        };
+        for (int t = begin; t < end; ++t) {
+            int tx = t % out.m_tilesX, ty = t / out.m_tilesX;
+            unsigned char* dst = out.tile(tx, ty);
+            int rows = std::min(ts, dh - ty * ts);
+            int cols = std::min(ts, dw - tx * ts);
+            int xEnd = spans(xs, tx * ts, cols, sw, dw), yEnd = spans(ys, ty * ts, rows, sh, dh);
+            colOffset.resize(size_t(xEnd - xs[0]));
+            for (int sx = xs[0]; sx < xEnd; ++sx)
+                colOffset[sx - xs[0]] = size_t(sx / ts) * tileBytes() + size_t(sx % ts) * ch;
+            rowOffset.resize(size_t(yEnd - ys[0]));
+            for (int sy = ys[0]; sy < yEnd; ++sy)
+                rowOffset[sy - ys[0]] = size_t(sy / ts) * m_tilesX * tileBytes() + size_t(sy % ts) * ts * ch;
+
+            for (int y = 0; y < rows; ++y) {
+                int y0 = ys[y] - ys[0], y1 = std::max(ys[y] + 1, ys[y + 1]) - ys[0];
+                unsigned char* o = dst + size_t(y) * ts * ch;
+                for (int x = 0; x < cols; ++x, o += ch) {
+                    int x0 = xs[x] - xs[0], x1 = std::max(xs[x] + 1, xs[x + 1]) - xs[0];
+                    unsigned sum[4] = {0, 0, 0, 0};
+                    for (int sy = y0; sy < y1; ++sy) {
+                        const unsigned char* row = base + rowOffset[sy];
+                        for (int sx = x0; sx < x1; ++sx) {
+                            const unsigned char* px = row + colOffset[sx];
+                            for (int c = 0; c < ch; ++c) sum[c] += px[c];
+                        }
+                    }
+                    unsigned area = unsigned((y1 - y0) * (x1 - x0));
+                    for (int c = 0; c < ch; ++c) o[c] = (unsigned char)((sum[c] + area / 2) / area);
+                }
+            }
+        }
+    });
+    *this = std::move(out);
+}
+
+void TiledImage::applyFilter(FilterType type) {
+    // Point filters do not care about the layout (padding included)
+    if (!m_tiles.empty()) filterPixels(m_tiles, m_channels, type);
+}
+
+// ==================== HDRIMAGE ====================
+namespace {
+
+inline uint32_t readLE32(const unsigned char* p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+float halfToFloat(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // Subnormal: normalise the mantissa
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            bits = sign | exponent << 23 | (mantissa & 0x3ff) << 13;
+        }
+    } else if (exponent == 31) {
+        bits = sign | 0x7f800000 | mantissa << 13;
+    } else {
+        bits = sign | (exponent + 127 - 15) << 23 | mantissa << 13;
+    }
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Undoes the byte split and delta predictor EXR applies before RLE/ZIP
+void exrUnpredict(std::vector<unsigned char>& data) {
+    for (size_t i = 1; i < data.size(); ++i) data[i] = (unsigned char)(data[i - 1] + data[i] - 128);
+    std::vector<unsigned char> out(data.size());
+    size_t half = (data.size() + 1) / 2;
+    for (size_t i = 0; i < data.size(); ++i) out[i] = i & 1 ? data[half + i / 2] : data[i / 2];
+    data = std::move(out);
+}
+
+bool exrRle(const unsigned char* in, size_t size, std::vector<unsigned char>& out, size_t expected) {
+    out.clear();
+    size_t i = 0;
+    while (i < size) {
+        int count = (signed char)in[i++];
+        if (count < 0) {
+            if (i + size_t(-count) > size) return false;
+            out.insert(out.end(), in + i, in + i - count);
+            i += size_t(-count);
+        } else {
+            if (i >= size) return false;
+            out.insert(out.end(), size_t(count) + 1, in[i++]);
+        }
+        if (out.size() > expected) return false;
+    }
+    return out.size() == expected;
+}
+
+struct ExrChannel {
+    std::string name;
+    int type; // 0 UINT, 1 HALF, 2 FLOAT
+};
+
+// sRGB encoding of [0, 1] through a 4096-entry table
+const unsigned char* srgbTable() {
+    static const auto table = [] {
+        std::vector<unsigned char> t(4096);
+        for (int i = 0; i < 4096; ++i) t[i] = (unsigned char)linearToSrgb(i / 4095.0f);
+        return t;
+    }();
+    return table.data();
+}
+
+// Linear float rows to 8-bit sRGB; the operator loops are branch-free so the
+// compiler can vectorise them
+void toneMapRows(const float* src, int width, int height, int channels, ToneMapOperator op, float exposure,
+                 unsigned char* dst) {
+    const unsigned char* table = srgbTable();
+    float scale = std::pow(2.0f, exposure);
+    size_t rowValues = size_t(width) * channels;
+    parallelFor(height, [&](int begin, int end) {
+        std::vector<float> row(rowValues);
+        for (int y = begin; y < end; ++y) {
+            const float* in = src + y * rowValues;
+            for (size_t i = 0; i < rowValues; ++i) row[i] = std::max(0.0f, in[i] * scale);
+            if (op == ToneMapOperator::Reinhard) {
+                for (size_t i = 0; i < rowValues; ++i) row[i] = row[i] / (1.0f + row[i]);
+            } else {
+                // Narkowicz's fit of the ACES filmic curve
+                for (size_t i = 0; i < rowValues; ++i) {
+                    float x = row[i];
+                    row[i] = std::min(1.0f, (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f));
+                }
+            }
+            unsigned char* out = dst + y * rowValues;
+            for (size_t i = 0; i < rowValues; ++i) {
+                if (channels == 4 && i % 4 == 3) {
+                    // Alpha is linear coverage, not tone mapped
+                    out[i] = (unsigned char)(std::min(1.0f, std::max(0.0f, in[i])) * 255 + 0.5f);
+                } else {
+                    out[i] = table[int(std::min(1.0f, row[i]) * 4095 + 0.5f)];
+                }
+            }
+        }
+    });
+}
+
+} // namespace
+
+std::shared_ptr<HdrImage> HdrImage::loadFromFile(const std::string& path) {
+    std::vector<unsigned char> bytes;
+    if (!readFile(path, bytes)) return nullptr;
+    return loadFromMemory(bytes.data(), bytes.size());
+}
+
+std::shared_ptr<HdrImage> HdrImage::loadFromMemory(const unsigned char* bytes, size_t size) {
+    if (!bytes || size == 0 || size > size_t(INT32_MAX)) return nullptr;
+    auto hdr = std::make_shared<HdrImage>();
+    if (size >= 4 && readLE32(bytes) == 0x01312f76) return hdr->loadExr(bytes, size) ? hdr : nullptr;
+
+    int w, h, channels;
+    float* data = stbi_loadf_from_memory(bytes, int(size), &w, &h, &channels, 0);
+    if (!data) return nullptr;
+    int outChannels = channels == 2 || channels == 4 ? 4 : 3;
+    hdr->m_width = w;
+    hdr->m_height = h;
+    hdr->m_channels = outChannels;
+    hdr->m_pixels.resize(size_t(w) * h * outChannels);
+    for (size_t i = 0; i < size_t(w) * h; ++i) {
+        const float* in = data + i * channels;
+        float* out = &hdr->m_pixels[i * outChannels];
+        out[0] = in[0];
+        out[1] = in[channels < 3 ? 0 : 1];
+        out[2] = in[channels < 3 ? 0 : 2];
+        if (outChannels == 4) out[3] = in[channels - 1];
+    }
+    stbi_image_free(data);
+    return hdr;
+}
+
+bool HdrImage::loadExr(const unsigned char* bytes, size_t size) {
+    if (size < 8) return false;
+    uint32_t version = readLE32(bytes + 4);
+    // Tiled, deep and multi-part files are not supported
+    if ((version & 0xff) != 2 || (version & (0x200 | 0x800 | 0x1000))) return false;
+
+    std::vector<ExrChannel> channels;
+    int compression = -1;
+    int32_t window[4] = {0, 0, -1, -1};
+    size_t pos = 8;
+    auto readString = [&](std::string& out) {
+        size_t end = pos;
+        while (end < size && bytes[end]) ++end;
+        if (end >= size) return false;
+        out.assign(reinterpret_cast<const char*>(bytes + pos), end - pos);
+        pos = end + 1;
+        return true;
+    };
+    for (;;) {
+        std::string name, type;
+        if (!readString(name)) return false;
+        if (name.empty()) break;
+        if (!readString(type) || pos + 4 > size) return false;
+        uint32_t attrSize = readLE32(bytes + pos);
+        pos += 4;
+        if (attrSize > size - pos) return false;
+        const unsigned char* value = bytes + pos;
+        if (name == "channels" && type == "chlist") {
+            size_t p = 0;
+            while (p < attrSize && value[p]) {
+                size_t end = p;
+                while (end < attrSize && value[end]) ++end;
+                if (end + 17 > attrSize) return false;
+                ExrChannel channel{std::string(reinterpret_cast<const char*>(value + p), end - p),
+                                   int(readLE32(value + end + 1))};
+                if (channel.type < 0 || channel.type > 2 || readLE32(value + end + 9) != 1 ||
+                    readLE32(value + end + 13) != 1)
+                    return false; // subsampled channels are not supported
+                channels.push_back(channel);
+                p = end + 17;
+            }
+        } else if (name == "compression" && attrSize >= 1) {
+            compression = value[0];
+        } else if (name == "dataWindow" && attrSize >= 16) {
+            for (int i = 0; i < 4; ++i) window[i] = int32_t(readLE32(value + 4 * i));
+        }
+        pos += attrSize;
+    }
+    if (compression < 0 || compression > 3 || channels.empty()) return false;
+    int64_t w64 = int64_t(window[2]) - window[0] + 1, h64 = int64_t(window[3]) - window[1] + 1;
+    if (w64 <= 0 || h64 <= 0 || w64 > INT_MAX || h64 > INT_MAX || w64 * h64 > (int64_t(1) << 31)) return false;
+    int width = int(w64), height = int(h64);
+
+    // Channels are stored in name order; find the ones we display
+    int r = -1, g = -1, b = -1, a = -1, yLum = -1;
+    size_t lineBytes = 0;
+    std::vector<size_t> channelOffset(channels.size());
+    for (size_t i = 0; i < channels.size(); ++i) {
+        channelOffset[i] = lineBytes;
+        lineBytes += size_t(width) * (channels[i].type == 1 ? 2 : 4);
+        const std::string& n = channels[i].name;
+        if (n == "R") r = int(i);
+        else if (n == "G") g = int(i);
+        else if (n == "B") b = int(i);
+        else if (n == "A") a = int(i);
+        else if (n == "Y") yLum = int(i);
+    }
+    if (r < 0 || g < 0 || b < 0) {
+        if (yLum < 0) return false;
+        r = g = b = yLum;
+    }
+    int outChannels = a >= 0 ? 4 : 3;
+    int linesPerBlock = compression == 3 ? 16 : 1;
+    if (lineBytes > size_t(INT_MAX) / linesPerBlock) return false; // zlib sizes are int
+    size_t blocks = size_t((height + linesPerBlock - 1) / linesPerBlock);
+    if (pos + blocks * 8 > size) return false;
+    const unsigned char* offsets = bytes + pos;
+
+    m_width = width;
+    m_height = height;
+    m_channels = outChannels;
+    m_pixels.assign(size_t(width) * height * outChannels, 0.0f);
+    std::atomic<bool> ok(true);
+    parallelFor(int(blocks), [&](int begin, int end) {
+        std::vector<unsigned char> block;
+        for (int i = begin; i < end && ok; ++i) {
+            uint64_t offset = uint64_t(readLE32(offsets + 8 * i)) | uint64_t(readLE32(offsets + 8 * i + 4)) << 32;
+            if (offset > size - 8) {
+                ok = false;
+                break;
+            }
+            int64_t first64 = int64_t(int32_t(readLE32(bytes + offset))) - window[1];
+            uint32_t packedSize = readLE32(bytes + offset + 4);
+            const unsigned char* packed = bytes + offset + 8;
+            // Chunks must start on a block boundary, or two could write the same lines
+            if (packedSize > size - offset - 8 || first64 < 0 || first64 >= height ||
+                first64 % linesPerBlock != 0) {
+                ok = false;
+                break;
+            }
+            int firstLine = int(first64);
+            int lines = std::min(linesPerBlock, height - firstLine);
+            size_t expected = lineBytes * lines;
+            // Chunks that did not shrink are stored as-is
+            if (compression == 0 || packedSize == expected) {
+                if (packedSize != expected) {
+                    ok = false;
+                    break;
+                }
+                block.assign(packed, packed + expected);
+            } else if (compression == 1) {
+                if (!exrRle(packed, packedSize, block, expected)) {
+                    ok = false;
+                    break;
+                }
+                exrUnpredict(block);
+            } else {
+                block.resize(expected);
+                int n = stbi_zlib_decode_buffer(reinterpret_cast<char*>(block.data()), int(expected),
+                                                reinterpret_cast<const char*>(packed), int(packedSize));
+                if (n != int(expected)) {
+                    ok = false;
+                    break;
+                }
+                exrUnpredict(block);
+            }
+            for (int line = 0; line < lines; ++line) {
+                const unsigned char* lineData = &block[line * lineBytes];
+                float* out = &m_pixels[size_t(firstLine + line) * width * outChannels];
+                int sources[4] = {r, g, b, a};
+                for (int c = 0; c < outChannels; ++c) {
+                    const ExrChannel& channel = channels[sources[c]];
+                    const unsigned char* in = lineData + channelOffset[sources[c]];
+                    for (int x = 0; x < width; ++x) {
+                        float v;
+                        if (channel.type == 1) {
+                            v = halfToFloat(uint16_t(in[2 * x] | in[2 * x + 1] << 8));
+                        } else if (channel.type == 2) {
+                            uint32_t bits = readLE32(in + 4 * x);
+                            std::memcpy(&v, &bits, sizeof(v));
+                        } else {
+                            v = float(readLE32(in + 4 * x));
+                        }
+                        out[size_t(x) * outChannels + c] = v;
+                    }
+                }
+            }
+        }
+    });
+    return ok;
+}
+
+int HdrImage::width() const { return m_width; }
+int HdrImage::height() const { return m_height; }
+int HdrImage::channels() const { return m_channels; }
+const std::vector<float>& HdrImage::data() const { return m_pixels; }
+
+std::shared_ptr<Image> HdrImage::toneMap(ToneMapOperator op, float exposure) const {
+    auto img = std::make_shared<Image>();
+    if (m_pixels.empty()) return img;
+    img->m_width = m_width;
+    img->m_height = m_height;
+    img->m_channels = m_channels;
+    img->m_pixels.resize(m_pixels.size());
+    toneMapRows(m_pixels.data(), m_width, m_height, m_channels, op, exposure, img->m_pixels.data());
+    return img;
+}
+
+std::shared_ptr<Image> HdrImage::toneMappedThumbnail(int maxWidth, int maxHeight, ToneMapOperator op,
+                                                     float exposure) const {
+    if (m_pixels.empty() || maxWidth <= 0 || maxHeight <= 0) return std::make_shared<Image>();
+    float f = std::min(1.0f, std::min(float(maxWidth) / m_width, float(maxHeight) / m_height));
+    int w = std::max(1, int(m_width * f)), h = std::max(1, int(m_height * f));
+    std::vector<float> small(size_t(w) * h * m_channels);
+    parallelFor(h, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            int y0 = int(int64_t(y) * m_height / h);
+            int y1 = std::max(y0 + 1, int(int64_t(y + 1) * m_height / h));
+            for (int x = 0; x < w; ++x) {
+                int x0 = int(int64_t(x) * m_width / w);
+                int x1 = std::max(x0 + 1, int(int64_t(x + 1) * m_width / w));
+                float sum[4] = {0, 0, 0, 0};
+                for (int sy = y0; sy < y1; ++sy) {
+                    const float* row = &m_pixels[(size_t(sy) * m_width + x0) * m_channels];
+                    for (int sx = x0; sx < x1; ++sx, row += m_channels)
+                        for (int c = 0; c < m_channels; ++c) sum[c] += row[c];
+                }
+                float inv = 1.0f / float((y1 - y0) * (x1 - x0));
+                for (int c = 0; c < m_channels; ++c) small[(size_t(y) * w + x) * m_channels + c] = sum[c] * inv;
+            }
+        }
+    });
+    auto img = std::make_shared<Image>();
+    img->m_width = w;
+    img->m_height = h;
+    img->m_channels = m_channels;
+    img->m_pixels.resize(small.size());
+    toneMapRows(small.data(), w, h, m_channels, op, exposure, img->m_pixels.data());
+    return img;
+}
+
+// ==================== RAWIMAGE ====================
+namespace {
+
+// Read-only view of a TIFF-structured file (DNG and most camera raws)
+struct TiffFile {
+    const unsigned char* bytes;
+    size_t size;
+    bool bigEndian;
+
+    uint32_t u16(size_t at) const {
+        if (at + 2 > size) return 0;
+        return bigEndian ? uint32_t(bytes[at]) << 8 | bytes[at + 1] : uint32_t(bytes[at + 1]) << 8 | bytes[at];
+    }
+    uint32_t u32(size_t at) const {
+        if (at + 4 > size) return 0;
+        return bigEndian ? readBE32(bytes + at) : readLE32(bytes + at);
+    }
+};
+
+struct TiffEntry {
+    uint32_t type = 0;
+    uint32_t count = 0;
+    size_t offset = 0; // of the first value
+};
+
+// One IFD's tags, keyed by tag number
+struct TiffIfd {
+    std::unordered_map<uint32_t, TiffEntry> entries;
+
+    bool has(uint32_t tag) const { return entries.count(tag) != 0; }
+    uint32_t count(uint32_t tag) const {
+        auto it = entries.find(tag);
+        return it == entries.end() ? 0 : it->second.count;
+    }
+    // index-th value of a numeric tag as double (fallback if missing)
+    double value(const TiffFile& f, uint32_t tag, uint32_t index = 0, double fallback = 0) const {
+        auto it = entries.find(tag);
+        if (it == entries.end() || index >= it->second.count) return fallback;
+        const TiffEntry& e = it->second;
+        switch (e.type) {
+            case 1: case 2: case 7: return e.offset + index < f.size ? f.bytes[e.offset + index] : fallback;
+            case 3: return f.u16(e.offset + 2 * index);
+            case 8: return int16_t(f.u16(e.offset + 2 * index));
+            case 4: case 13: return f.u32(e.offset + 4 * index);
+            case 9: return int32_t(f.u32(e.offset + 4 * index));
+            case 5: case 10: {
+                double num = e.type == 5 ? double(f.u32(e.offset + 8 * index)) : int32_t(f.u32(e.offset + 8 * index));
+                double den = e.type == 5 ? double(f.u32(e.offset + 8 * index + 4))
+                                         : int32_t(f.u32(e.offset + 8 * index + 4));
+                return den != 0 ? num / den : fallback;
+            }
+            case 11: {
+                uint32_t bits = f.u32(e.offset + 4 * index);
+                float v;
+                std::memcpy(&v, &bits, sizeof(v));
+                return v;
+            }
+            default: return fallback;
+        }
+    }
+};
+
+// Reads IFD0, its chain and all SubIFDs (tag 330); false if not a TIFF
+bool readTiff(const unsigned char* bytes, size_t size, TiffFile& file, std::vector<TiffIfd>& ifds) {
+    if (size < 8) return false;
+    if (bytes[0] == 'I' && bytes[1] == 'I') file = TiffFile{bytes, size, false};
+    else if (bytes[0] == 'M' && bytes[1] == 'M') file = TiffFile{bytes, size, true};
+    else return false;
+    if (file.u16(2) != 42) return false;
+    static const uint32_t typeSize[14] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4};
+    std::vector<uint32_t> pending{file.u32(4)};
+    std::vector<uint32_t> seen;
+    while (!pending.empty() && ifds.size() < 64) {
+        uint32_t at = pending.back();
+        pending.pop_back();
+        if (at == 0 || at + 2 > size || std::find(seen.begin(), seen.end(), at) != seen.end()) continue;
+        seen.push_back(at);
+        uint32_t n = file.u16(at);
+        if (at + 2 + size_t(n) * 12 + 4 > size) continue;
+        TiffIfd ifd;
+        for (uint32_t i = 0; i < n; ++i) {
+            size_t entry = at + 2 + size_t(i) * 12;
+            TiffEntry e;
+            uint32_t tag = file.u16(entry);
+            e.type = file.u16(entry + 2);
+            e.count = file.u32(entry + 4);
+            if (e.type == 0 || e.type > 13) continue;
+            uint64_t bytesNeeded = uint64_t(typeSize[e.type]) * e.count;
+            e.offset = bytesNeeded <= 4 ? entry + 8 : file.u32(entry + 8);
+            if (e.offset + bytesNeeded > size) continue;
+            ifd.entries[tag] = e;
+        }
+        for (uint32_t i = 0; i < ifd.count(330); ++i) pending.push_back(uint32_t(ifd.value(file, 330, i)));
+        uint32_t next = file.u32(at + 2 + size_t(n) * 12);
+        if (next) pending.push_back(next);
+        ifds.push_back(std::move(ifd));
+    }
+    return !ifds.empty();
+}
+
+// Lossless JPEG (ITU T.81 process 14), as used for DNG raw tiles. Samples
+// are returned row-major, width * components per row; frames with more than
+// maxSamples samples are rejected before anything is allocated.
+struct LjpegTable {
+    int maxCode[18];
+    int valPtr[17];
+    int minCode[17];
+    unsigned char values[256];
+};
+
+bool ljpegDecode(const unsigned char* data, size_t size, size_t maxSamples, std::vector<uint16_t>& out,
+                 int& width, int& height, int& components) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+    LjpegTable tables[4];
+    bool haveTable[4] = {false, false, false, false};
+    int precision = 0, componentTable[4] = {0, 0, 0, 0};
+    int componentIds[4] = {0, 0, 0, 0};
+    width = height = components = 0;
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        int marker = data[pos + 1];
+        size_t length = size_t(data[pos + 2]) << 8 | data[pos + 3];
+        const unsigned char* seg = data + pos + 4;
+        if (length < 2 || pos + 2 + length > size) return false;
+        size_t segLength = length - 2;
+        pos += 2 + length;
+        if (marker == 0xC3) {
+            if (segLength < 6) return false;
+            precision = seg[0];
+            height = seg[1] << 8 | seg[2];
+            width = seg[3] << 8 | seg[4];
+            components = seg[5];
+            if (components < 1 || components > 4 || segLength < 6 + size_t(components) * 3) return false;
+            for (int c = 0; c < components; ++c) componentIds[c] = seg[6 + c * 3];
+        } else if (marker == 0xC4) {
+            size_t i = 0;
+            while (i + 17 <= segLength) {
+                int index = seg[i] & 15;
+                if (index > 3) return false;
+                LjpegTable& t = tables[index];
+                const unsigned char* counts = seg + i + 1;
+                size_t total = 0;
+                for (int l = 0; l < 16; ++l) total += counts[l];
+                if (total > 256 || i + 17 + total > segLength) return false;
+                std::memcpy(t.values, seg + i + 17, total);
+                // Canonical code ranges per length (T.81 F.2.2.3)
+                int code = 0, k = 0;
+                for (int l = 1; l <= 16; ++l) {
+                    t.valPtr[l] = k;
+                    t.minCode[l] = code;
+                    code += counts[l - 1];
+                    k += counts[l - 1];
+                    t.maxCode[l] = counts[l - 1] ? code - 1 : -1;
+                    code <<= 1;
+                }
+                t.maxCode[17] = INT32_MAX;
+                haveTable[index] = true;
+                i += 17 + total;
+            }
+        } else if (marker == 0xDD) {
+            if (segLength >= 2 && (seg[0] | seg[1])) return false; // restart intervals are not supported
+        } else if (marker == 0xDA) {
+            if (segLength < 1 || !components || width <= 0 || height <= 0) return false;
+            int count = seg[0];
+            if (count != components || segLength < 4 + size_t(count) * 2) return false;
+            for (int c = 0; c < count; ++c) {
+                int id = seg[1 + c * 2], table = seg[2 + c * 2] >> 4;
+                int slot = 0;
+                while (slot < components && componentIds[slot] != id) ++slot;
+                if (slot == components || table > 3 || !haveTable[table]) return false;
+                componentTable[slot] = table;
+            }
+            int predictor = seg[1 + count * 2];
+            int transform = seg[3 + count * 2] & 15;
+            if (predictor < 1 || predictor > 7 || precision < 2 || precision > 16) return false;
+
+            // Every sample takes at least one bit, so a short stream cannot
+            // claim a large frame
+            size_t rowSamples = size_t(width) * components;
+            if (rowSamples * height > maxSamples || rowSamples * height > (size - pos) * 8) return false;
+
+            // Entropy-coded data: 0xFF00 is a stuffed 0xFF, any other marker ends it
+            // and zeros are fed after it. Once more zero bytes have been fed than
+            // the bit buffer holds, the data is exhausted and decoding stops.
+            uint32_t buffer = 0;
+            int bits = 0, padding = 0;
+            auto fill = [&]() {
+                while (bits <= 24) {
+                    unsigned b = 0;
+                    if (pos < size && (data[pos] != 0xFF || (pos + 1 < size && data[pos + 1] == 0))) {
+                        b = data[pos];
+                        pos += b == 0xFF ? 2 : 1;
+                    } else {
+                        ++padding;
+                    }
+                    buffer |= b << (24 - bits);
+                    bits += 8;
+                }
+            };
+            auto getBits = [&](int n) {
+                fill();
+                uint32_t v = buffer >> (32 - n);
+                buffer <<= n;
+                bits -= n;
+                return v;
+            };
+            auto decodeDiff = [&](const LjpegTable& t) -> int {
+                fill();
+                if (padding > 4) return INT32_MIN;
+                int code = 0, l = 0;
+                do {
+                    code = code << 1 | int(buffer >> 31);
+                    buffer <<= 1;
+                    --bits;
+                    ++l;
+                } while (l <= 16 && code > t.maxCode[l]);
+                if (l > 16) return INT32_MIN;
+                int ssss = t.values[t.valPtr[l] + code - t.minCode[l]];
+                if (ssss > 16) return INT32_MIN;
+                if (ssss == 0) return 0;
+                if (ssss == 16) return 32768;
+                int v = int(getBits(ssss));
+                return v < (1 << (ssss - 1)) ? v - (1 << ssss) + 1 : v;
+            };
+
+            out.assign(rowSamples * height, 0);
+            for (int y = 0; y < height; ++y) {
+                uint16_t* row = &out[y * rowSamples];
+                const uint16_t* above = y ? row - rowSamples : nullptr;
+                for (int x = 0; x < width; ++x) {
+                    for (int c = 0; c < components; ++c) {
+                        int diff = decodeDiff(tables[componentTable[c]]);
+                        if (diff == INT32_MIN) return false;
+                        size_t i = size_t(x) * components + c;
+                        int pred;
+                        if (y == 0 && x == 0) pred = 1 << (precision - transform - 1);
+                        else if (y == 0) pred = row[i - components];
+                        else if (x == 0) pred = above[i];
+                        else {
+                            int ra = row[i - components], rb = above[i], rc = above[i - components];
+                            switch (predictor) {
+                                case 1: pred = ra; break;
+                                case 2: pred = rb; break;
+                                case 3: pred = rc; break;
+                                case 4: pred = ra + rb - rc; break;
+                                case 5: pred = ra + ((rb - rc) >> 1); break;
+                                case 6: pred = rb + ((ra - rc) >> 1); break;
+                                default: pred = (ra + rb) >> 1; break;
+                            }
+                        }
+                        row[i] = uint16_t(pred + diff);
+                    }
+                }
+            }
+            if (transform)
+                for (auto& v : out) v = uint16_t(v << transform);
+            return true;
+        } else if (marker == 0xD9) {
+            break;
+        }
+    }
+    return false;
+}
+
+// sRGB (D65) to XYZ
+const double kXyzFromSrgb[9] = {0.412453, 0.357580, 0.180423, 0.212671, 0.715160,
+                                0.072169, 0.019334, 0.119193, 0.950227};
+
+bool invert3x3(const double* m, double* inv) {
+    double det = m[0] * (m[4] * m[8] - m[5] * m[7]) - m[1] * (m[3] * m[8] - m[5] * m[6]) +
+                 m[2] * (m[3] * m[7] - m[4] * m[6]);
+    if (std::fabs(det) < 1e-12) return false;
+    inv[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+    inv[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+    inv[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+    inv[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+    inv[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+    inv[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+    inv[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+    inv[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+    inv[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+    return true;
+}
+
+} // namespace
+
+std::shared_ptr<RawImage> RawImage::loadFromFile(const std::string& path) {
+    std::vector<unsigned char> bytes;
+    if (!readFile(path, bytes)) return nullptr;
+    return loadFromMemory(bytes.data(), bytes.size());
+}
+
+std::shared_ptr<RawImage> RawImage::loadFromMemory(const unsigned char* bytes, size_t size) {
+    TiffFile file;
+    std::vector<TiffIfd> ifds;
+    if (!bytes || !readTiff(bytes, size, file, ifds)) return nullptr;
+
+    // The full-resolution CFA image: photometric 32803, largest of them
+    const TiffIfd* raw = nullptr;
+    for (const auto& ifd : ifds)
+        if (ifd.value(file, 262) == 32803 && (!raw || ifd.value(file, 256) > raw->value(file, 256))) raw = &ifd;
+    if (!raw) return nullptr;
+    int width = int(raw->value(file, 256)), height = int(raw->value(file, 257));
+    int bps = int(raw->value(file, 258, 0, 16));
+    int compression = int(raw->value(file, 259, 0, 1));
+    if (width <= 0 || height <= 0 || int64_t(width) * height > (int64_t(1) << 30) || bps < 1 || bps > 16 ||
+        raw->value(file, 277, 0, 1) != 1 || (compression != 1 && compression != 7))
+        return nullptr;
+    if (raw->has(33421) && (raw->value(file, 33421, 0) != 2 || raw->value(file, 33421, 1) != 2))
+        return nullptr; // only 2x2 Bayer patterns
+
+    auto img = std::make_shared<RawImage>();
+    img->m_width = width;
+    img->m_height = height;
+    if (raw->count(33422) >= 4) {
+        // CFAPattern values index CFAPlaneColor (default R, G, B)
+        const TiffIfd& ifd0 = ifds[0];
+        for (int i = 0; i < 4; ++i) {
+            int plane = int(raw->value(file, 33422, i));
+            int color = ifd0.count(50710) > uint32_t(plane) ? int(ifd0.value(file, 50710, plane)) : plane;
+            if (color < 0 || color > 2) return nullptr;
+            img->m_pattern[i] = color;
+        }
+    }
+
+    // Blocks are tiles or strips; each is decoded independently
+    bool tiled = raw->has(322) && raw->has(324);
+    int blockW = tiled ? int(raw->value(file, 322)) : width;
+    int blockH = tiled ? int(raw->value(file, 323)) : int(raw->value(file, 278, 0, height));
+    uint32_t offsetsTag = tiled ? 324 : 273, countsTag = tiled ? 325 : 279;
+    if (blockW <= 0 || blockH <= 0) return nullptr;
+    blockH = std::min(blockH, height);
+    int across = (width + blockW - 1) / blockW;
+    int blocks = across * ((height + blockH - 1) / blockH);
+    if (int(raw->count(offsetsTag)) < blocks || int(raw->count(countsTag)) < blocks) return nullptr;
+
+    std::vector<uint16_t> linear;
+    for (uint32_t i = 0; i < raw->count(50712) && i < 65536; ++i)
+        linear.push_back(uint16_t(raw->value(file, 50712, i)));
+
+    img->m_cfa.assign(size_t(width) * height, 0);
+    std::atomic<bool> ok(true);
+    parallelFor(blocks, [&](int begin, int end) {
+        std::vector<uint16_t> samples;
+        for (int b = begin; b < end && ok; ++b) {
+            size_t offset = size_t(raw->value(file, offsetsTag, b)), count = size_t(raw->value(file, countsTag, b));
+            if (offset > size || count > size - offset) {
+                ok = false;
+                break;
+            }
+            const unsigned char* src = bytes + offset;
+            int x0 = (b % across) * blockW, y0 = (b / across) * blockH;
+            int w = std::min(blockW, width - x0), h = std::min(blockH, height - y0);
+            // Samples of the block in row-major order, blockW per row
+            if (compression == 7) {
+                // The JPEG frame may interleave components, but its rows must
+                // still be blockW samples wide and cover the whole block
+                int jw, jh, jc;
+                if (!ljpegDecode(src, count, size_t(blockW) * blockH, samples, jw, jh, jc) ||
+                    size_t(jw) * jc != size_t(blockW) || jh < h) {
+                    ok = false;
+                    break;
+                }
+            } else {
+                size_t rowBytes = (size_t(blockW) * bps + 7) / 8;
+                int rows = tiled ? blockH : h;
+                if (rowBytes * rows > count) {
+                    ok = false;
+                    break;
+                }
+                samples.resize(size_t(blockW) * rows);
+                for (int y = 0; y < rows; ++y) {
+                    const unsigned char* row = src + y * rowBytes;
+                    uint16_t* dst = &samples[size_t(y) * blockW];
+                    if (bps == 8) {
+                        for (int x = 0; x < blockW; ++x) dst[x] = row[x];
+                    } else if (bps == 16) {
+                        for (int x = 0; x < blockW; ++x)
+                            dst[x] = uint16_t(file.bigEndian ? row[2 * x] << 8 | row[2 * x + 1]
+                                                             : row[2 * x + 1] << 8 | row[2 * x]);
+                    } else {
+                        // Packed MSB first, rows start on a byte boundary
+                        uint64_t bit = 0;
+                        for (int x = 0; x < blockW; ++x, bit += bps) {
+                            uint32_t v = 0;
+                            for (size_t k = bit >> 3; k <= (bit + bps - 1) >> 3; ++k) v = v << 8 | row[k];
+                            int spare = int(8 - ((bit + bps) & 7)) & 7;
+                            dst[x] = uint16_t((v >> spare) & ((1u << bps) - 1));
+                        }
+                    }
+                }
+            }
+            if (size_t(h - 1) * blockW + w > samples.size()) {
+                ok = false;
+                break;
+            }
+            for (int y = 0; y < h; ++y) {
+                const uint16_t* srcRow = &samples[size_t(y) * blockW];
+                uint16_t* dst = &img->m_cfa[size_t(y0 + y) * width + x0];
+                for (int x = 0; x < w; ++x)
+                    dst[x] = linear.empty() ? srcRow[x] : linear[std::min<size_t>(srcRow[x], linear.size() - 1)];
+            }
+        }
+    });
+    if (!ok) return nullptr;
+
+    // Levels; BlackLevel may give one value or one per pattern position
+    uint32_t blacks = raw->count(50714);
+    for (int i = 0; i < 4; ++i)
+        img->m_black[i] = float(raw->value(file, 50714, blacks >= 4 ? uint32_t(i) : 0, 0));
+    img->m_white = float(raw->value(file, 50717, 0, linear.empty() ? (1 << bps) - 1 : 65535));
+    if (img->m_white <= img->m_black[0]) img->m_white = img->m_black[0] + 1;
+
+    // White balance and color matrix live in IFD0
+    const TiffIfd& ifd0 = ifds[0];
+    if (ifd0.count(50728) >= 3) {
+        for (int c = 0; c < 3; ++c) {
+            double neutral = ifd0.value(file, 50728, c, 1);
+            img->m_gains[c] = neutral > 0 ? float(1 / neutral) : 1.0f;
+        }
+        float g = img->m_gains[1];
+        for (auto& gain : img->m_gains) gain /= g;
+    }
+    uint32_t matrixTag = ifd0.count(50722) >= 9 ? 50722 : ifd0.count(50721) >= 9 ? 50721 : 0;
+    if (matrixTag) {
+        // ColorMatrix maps XYZ to camera; camera = ColorMatrix * XYZ(sRGB),
+        // rows normalised so white stays white, then inverted
+        double xyzToCam[9], camFromSrgb[9], srgbFromCam[9];
+        for (int i = 0; i < 9; ++i) xyzToCam[i] = ifd0.value(file, matrixTag, i);
+        for (int r = 0; r < 3; ++r) {
+            double sum = 0;
+            for (int c = 0; c < 3; ++c) {
+                double v = 0;
+                for (int k = 0; k < 3; ++k) v += xyzToCam[r * 3 + k] * kXyzFromSrgb[k * 3 + c];
+                camFromSrgb[r * 3 + c] = v;
+                sum += v;
+            }
+            if (sum != 0)
+                for (int c = 0; c < 3; ++c) camFromSrgb[r * 3 + c] /= sum;
+        }
+        if (invert3x3(camFromSrgb, srgbFromCam))
+            for (int i = 0; i < 9; ++i) img->m_matrix[i] = float(srgbFromCam[i]);
+    }
+    return img;
+}
+
+std::shared_ptr<Image> RawImage::extractPreview(const std::string& path) {
+    std::vector<unsigned char> bytes;
+    if (!readFile(path, bytes)) return nullptr;
+    return extractPreview(bytes.data(), bytes.size());
+}
+
+std::shared_ptr<Image> RawImage::extractPreview(const unsigned char* bytes, size_t size) {
+    TiffFile file;
+    std::vector<TiffIfd> ifds;
+    if (!bytes || !readTiff(bytes, size, file, ifds)) return nullptr;
+    // Candidates: JPEGInterchangeFormat, or a single-strip baseline JPEG IFD
+    size_t bestOffset = 0, bestSize = 0;
+    for (const auto& ifd : ifds) {
+        size_t offset = 0, length = 0;
+        if (ifd.has(513) && ifd.has(514)) {
+            offset = size_t(ifd.value(file, 513));
+            length = size_t(ifd.value(file, 514));
+        } else if ((ifd.value(file, 259) == 7 || ifd.value(file, 259) == 6) && ifd.value(file, 262) != 32803 &&
+                   ifd.count(273) == 1 && ifd.count(279) == 1) {
+            offset = size_t(ifd.value(file, 273));
+            length = size_t(ifd.value(file, 279));
+        }
+        // Baseline/progressive JPEG only (lossless JPEG starts with SOF3)
+        if (offset == 0 || length < 4 || offset > size || length > size - offset) continue;
+        if (bytes[offset] != 0xFF || bytes[offset + 1] != 0xD8) continue;
+        if (length > bestSize) {
+            bestOffset = offset;
+            bestSize = length;
+        }
+    }
+    if (!bestSize) return nullptr;
+    auto img = std::make_shared<Image>();
+    if (!img->loadFromMemory(bytes + bestOffset, bestSize)) return nullptr;
+    return img;
+}
+
+int RawImage::width() const { return m_width; }
+int RawImage::height() const { return m_height; }
+const std::vector<uint16_t>& RawImage::data() const { return m_cfa; }
+
+std::shared_ptr<Image> RawImage::develop(bool halfSize) const {
+    auto img = std::make_shared<Image>();
+    if (m_cfa.empty()) return img;
+    int outW = halfSize ? std::max(1, m_width / 2) : m_width;
+    int outH = halfSize ? std::max(1, m_height / 2) : m_height;
+    img->m_width = outW;
+    img->m_height = outH;
+    img->m_channels = 3;
+    img->m_pixels.resize(size_t(outW) * outH * 3);
+
+    // White balance and the per-position black level folded into one scale
+    float scale[4][3];
+    for (int i = 0; i < 4; ++i)
+        for (int c = 0; c < 3; ++c) scale[i][c] = m_gains[c] / std::max(1.0f, m_white - m_black[i]);
+    const unsigned char* table = srgbTable();
+    auto encode = [&](float v) { return table[int(std::min(1.0f, std::max(0.0f, v)) * 4095 + 0.5f)]; };
+
+    // Generic path for border pixels, where the neighbourhood is clipped
+    auto sample = [&](int x, int y) { return float(m_cfa[size_t(y) * m_width + x]) - m_black[(y & 1) * 2 + (x & 1)]; };
+    auto border = [&](int x, int y, unsigned char* out) {
+        float cam[3] = {0, 0, 0}, weight[3] = {0, 0, 0};
+        if (halfSize) {
+            // One 2x2 block: both greens averaged
+            for (int k = 0; k < 4; ++k) {
+                int sx = std::min(m_width - 1, 2 * x + (k & 1)), sy = std::min(m_height - 1, 2 * y + (k >> 1));
+                int pos = (sy & 1) * 2 + (sx & 1), color = m_pattern[pos];
+                cam[color] += sample(sx, sy) * scale[pos][color];
+                weight[color] += 1;
+            }
+        } else {
+            // Bilinear: a missing color is the mean of that color in the 3x3 neighbourhood
+            int own = m_pattern[(y & 1) * 2 + (x & 1)];
+            for (int dy = -1; dy <= 1; ++dy) {
+                int sy = y + dy;
+                if (sy < 0 || sy >= m_height) continue;
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int sx = x + dx;
+                    if (sx < 0 || sx >= m_width) continue;
+                    int pos = (sy & 1) * 2 + (sx & 1), color = m_pattern[pos];
+                    if (color == own && (dx || dy)) continue;
+                    cam[color] += sample(sx, sy) * scale[pos][color];
+                    weight[color] += 1;
+                }
+            }
+        }
+        for (int c = 0; c < 3; ++c) cam[c] = weight[c] ? cam[c] / weight[c] : 0;
+        for (int r = 0; r < 3; ++r)
+            out[r] = encode(m_matrix[r * 3] * cam[0] + m_matrix[r * 3 + 1] * cam[1] + m_matrix[r * 3 + 2] * cam[2]);
+    };
+
+    // Interior: with the neighbourhood complete, averaging, black level,
+    // white balance and the color matrix fold into one weight per output
+    // channel for each group of samples sharing a CFA position, plus a bias.
+    // Groups for a pixel at position p are p ^ g: g = 0 centre, 1 left/right,
+    // 2 up/down, 3 diagonals. halfSize uses the four positions of a block.
+    float weights[4][4][3] = {}, bias[4][3] = {};
+    for (int p = 0; p < (halfSize ? 1 : 4); ++p) {
+        int own = m_pattern[p];
+        int count[4];
+        float total[3] = {0, 0, 0};
+        for (int g = 0; g < 4; ++g) {
+            int color = m_pattern[p ^ g];
+            count[g] = halfSize || g == 0 ? 1 : g == 3 ? 4 : 2;
+            if (!halfSize && g > 0 && color == own) count[g] = 0; // own color comes from the centre only
+            total[color] += float(count[g]);
+        }
+        for (int g = 0; g < 4; ++g) {
+            int q = p ^ g, color = m_pattern[q];
+            if (!count[g]) continue;
+            for (int r = 0; r < 3; ++r) {
+                weights[p][g][r] = m_matrix[r * 3 + color] * scale[q][color] / total[color];
+                bias[p][r] -= weights[p][g][r] * float(count[g]) * m_black[q];
+            }
+        }
+    }
+
+    parallelFor(outH, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            unsigned char* out = &img->m_pixels[size_t(y) * outW * 3];
+            if (halfSize) {
+                if (2 * y + 1 >= m_height || m_width < 2) {
+                    for (int x = 0; x < outW; ++x) border(x, y, out + size_t(x) * 3);
+                    continue;
+                }
+                const uint16_t* r0 = &m_cfa[size_t(2 * y) * m_width];
+                const uint16_t* r1 = r0 + m_width;
+                const float(*w)[3] = weights[0];
+                for (int x = 0; x < outW; ++x, out += 3) {
+                    float a = r0[2 * x], b = r0[2 * x + 1], c = r1[2 * x], d = r1[2 * x + 1];
+                    for (int r = 0; r < 3; ++r)
+                        out[r] = encode(w[0][r] * a + w[1][r] * b + w[2][r] * c + w[3][r] * d + bias[0][r]);
+                }
+                continue;
+            }
+            if (y == 0 || y == m_height - 1 || m_width < 3) {
+                for (int x = 0; x < outW; ++x) border(x, y, out + size_t(x) * 3);
+                continue;
+            }
+            border(0, y, out);
+            border(m_width - 1, y, out + size_t(m_width - 1) * 3);
+            const uint16_t* mid = &m_cfa[size_t(y) * m_width];
+            const uint16_t* up = mid - m_width;
+            const uint16_t* down = mid + m_width;
+            const int parity = (y & 1) * 2;
+            out += 3;
+            for (int x = 1; x < m_width - 1; ++x, out += 3) {
+                const int p = parity | (x & 1);
+                float centre = mid[x], h = float(mid[x - 1]) + mid[x + 1], v = float(up[x]) + down[x];
+                float d = float(up[x - 1]) + up[x + 1] + down[x - 1] + down[x + 1];
+                for (int r = 0; r < 3; ++r)
+                    out[r] = encode(weights[p][0][r] * centre + weights[p][1][r] * h + weights[p][2][r] * v +
+                                    weights[p][3][r] * d + bias[p][r]);
+            }
+        }
+    });
+    return img;
+}
+
+// ==================== IMAGELIST ====================
+void ImageList::add(std::shared_ptr<Image> img) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_images.push_back(img);
+}
+
+void ImageList::remove(size_t index) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (index >= m_images.size()) return;
+    m_images.erase(m_images.begin() + index);
+}
+
+std::shared_ptr<Image> ImageList::at(size_t index) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (index >= m_images.size()) return nullptr;
+    return m_images[index];
+}
+
+size_t ImageList::count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_images.size();
+}
+
+void ImageList::shuffle() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::random_device rd;
+    std::mt19937 g(rd());
+    std::shuffle(m_images.begin(), m_images.end(), g);
+}
+
+void ImageList::sort(bool (*comparator)(std::shared_ptr<Image>, std::shared_ptr<Image>)) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::sort(m_images.begin(), m_images.end(), comparator);
+}
+
+void ImageList::lock() { m_mutex.lock(); }
+void ImageList::unlock() { m_mutex.unlock(); }
+
+// ==================== SHAREDIMAGE ====================
+namespace {
+
+// Leading block of every segment; pixels start at kSharedPixelOffset
+struct SharedHeader {
+    uint32_t magic;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    uint64_t stride;
+};
+const uint32_t kSharedMagic = 0x31564959; // "YIV1"
+const size_t kSharedPixelOffset = 64;
+
+} // namespace
+
+SharedImage::~SharedImage() {
+#ifdef YIV_HAVE_POSIX
+    if (m_mapping) munmap(m_mapping, m_size);
+    if (m_fd >= 0) close(m_fd);
+#endif
+}
+
+std::shared_ptr<SharedImage> SharedImage::map(int fd, const std::string& name, size_t size, bool writable) {
+#ifdef YIV_HAVE_POSIX
+    void* mapping = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    std::shared_ptr<SharedImage> shared(new SharedImage());
+    shared->m_name = name;
+    shared->m_fd = fd;
+    shared->m_mapping = mapping;
+    shared->m_size = size;
+    shared->m_writable = writable;
+    return shared;
+#else
+    return nullptr;
+#endif
+}
+
+std::shared_ptr<SharedImage> SharedImage::create(const std::string& name, int width, int height, int channels) {
+#ifdef YIV_HAVE_POSIX
+    if (width <= 0 || height <= 0 || channels <= 0 || channels > 4) return nullptr;
+    size_t stride = size_t(width) * channels;
+    if (size_t(height) > (SIZE_MAX - kSharedPixelOffset) / stride) return nullptr;
+    size_t size = kSharedPixelOffset + stride * height;
+
+    int fd = -1;
+    if (name.empty()) {
+#ifdef __linux__
+        fd = memfd_create("yiv-image", MFD_CLOEXEC);
+#endif
+    } else {
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if (fd < 0) return nullptr;
+    if (ftruncate(fd, off_t(size)) != 0) {
+        close(fd);
+        if (!name.empty()) shm_unlink(name.c_str());
+        return nullptr;
+    }
+    auto shared = map(fd, name, size, true);
+    if (!shared) {
+        if (!name.empty()) shm_unlink(name.c_str());
+        return nullptr;
+    }
+    SharedHeader header{kSharedMagic, width, height, channels, stride};
+    std::memcpy(shared->m_mapping, &header, sizeof(header));
+    return shared;
+#else
+    return nullptr;
+#endif
+}
+
+std::shared_ptr<SharedImage> SharedImage::create(const std::string& name, const Image& image) {
+    if (image.isIndexed()) {
+        Image expanded(image);
+        expanded.expandPalette();
+        return create(name, expanded);
+    }
+    ImageView src = image.view();
+    auto shared = create(name, src.width, src.height, src.channels);
+    if (shared) std::memcpy(shared->data(), src.data, src.stride * src.height);
+    return shared;
+}
+
+std::shared_ptr<SharedImage> SharedImage::createFromFile(const std::string& name, const std::string& path) {
+    // Decoder output goes straight into the segment, never into an Image
+    int width, height, channels;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 0);
+    if (!data) return nullptr;
+    auto shared = create(name, width, height, channels);
+    if (shared) std::memcpy(shared->data(), data, size_t(width) * height * channels);
+    stbi_image_free(data);
+    return shared;
+}
+
+std::shared_ptr<SharedImage> SharedImage::attach(const std::string& name) {
+#ifdef YIV_HAVE_POSIX
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return nullptr;
+    auto shared = attach(fd);
+    close(fd);
+    if (shared) shared->m_name = name;
+    return shared;
+#else
+    return nullptr;
+#endif
+}
+
+std::shared_ptr<SharedImage> SharedImage::attach(int fd) {
+#ifdef YIV_HAVE_POSIX
+    int own = dup(fd);
+    if (own < 0) return nullptr;
+    struct stat st;
+    if (fstat(own, &st) != 0 || size_t(st.st_size) < kSharedPixelOffset) {
+        close(own);
+        return nullptr;
+    }
+    auto shared = map(own, std::string(), size_t(st.st_size), false);
+    if (!shared) return nullptr;
+    // The segment is written by another process; trust nothing view() uses
+    const SharedHeader* header = static_cast<const SharedHeader*>(shared->m_mapping);
+    if (header->magic != kSharedMagic || header->width <= 0 || header->height <= 0 ||
+        header->channels <= 0 || header->channels > 4 ||
+        header->stride < uint64_t(header->width) * uint64_t(header->channels) ||
+        uint64_t(header->height) > (shared->m_size - kSharedPixelOffset) / header->stride)
+        return nullptr;
+    return shared;
+#else
+    (void)fd;
+    return nullptr;
+#endif
+}
+
+ImageView SharedImage::view() const {
+    const SharedHeader* header = static_cast<const SharedHeader*>(m_mapping);
+    return ImageView{static_cast<const unsigned char*>(m_mapping) + kSharedPixelOffset,
+                     header->width, header->height, header->channels, size_t(header->stride)};
+}
+
+unsigned char* SharedImage::data() {
+    if (!m_writable) return nullptr;
+    return static_cast<unsigned char*>(m_mapping) + kSharedPixelOffset;
+}
+
+int SharedImage::fd() const { return m_fd; }
+const std::string& SharedImage::name() const { return m_name; }
+
+void SharedImage::unlink() {
+#ifdef YIV_HAVE_POSIX
+    if (!m_name.empty()) shm_unlink(m_name.c_str());
+#endif
+}
+
+// ==================== MAPPEDIMAGE ====================
+MappedImage::~MappedImage() {
+#ifdef YIV_HAVE_POSIX
+    if (m_mapping) munmap(m_mapping, m_size);
+#endif
+}
+
+std::shared_ptr<MappedImage> MappedImage::open(const std::string& path) {
+#ifdef YIV_HAVE_POSIX
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = size_t(st.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (mapping == MAP_FAILED) return nullptr;
+    if (!rawHeader(static_cast<const unsigned char*>(mapping), size)) {
+        munmap(mapping, size);
+        return nullptr;
+    }
+    std::shared_ptr<MappedImage> mapped(new MappedImage());
+    mapped->m_mapping = mapping;
+    mapped->m_size = size;
+    return mapped;
+#else
+    (void)path;
+    return nullptr;
+#endif
+}
+
+int MappedImage::width() const { return static_cast<const RawHeader*>(m_mapping)->width; }
+int MappedImage::height() const { return static_cast<const RawHeader*>(m_mapping)->height; }
+int MappedImage::channels() const { return static_cast<const RawHeader*>(m_mapping)->channels; }
+int MappedImage::tileSize() const { return static_cast<const RawHeader*>(m_mapping)->tileSize; }
+
+ImageView MappedImage::view() const {
+    const RawHeader* h = static_cast<const RawHeader*>(m_mapping);
+    if (h->tileSize != 0) return ImageView();
+    return ImageView{static_cast<const unsigned char*>(m_mapping) + h->dataOffset,
+                     h->width, h->height, h->channels, size_t(h->stride)};
+}
+
+ImageView MappedImage::tile(int tileX, int tileY) const {
+    const RawHeader* h = static_cast<const RawHeader*>(m_mapping);
+    int ts = h->tileSize;
+    if (ts == 0) return tileX == 0 && tileY == 0 ? view() : ImageView();
+    int tilesX = (h->width + ts - 1) / ts;
+    int tilesY = (h->height + ts - 1) / ts;
+    if (tileX < 0 || tileY < 0 || tileX >= tilesX || tileY >= tilesY) return ImageView();
+    const unsigned char* base = static_cast<const unsigned char*>(m_mapping) + h->dataOffset;
+    return ImageView{base + (size_t(tileY) * tilesX + tileX) * h->stride * ts,
+                     std::min(ts, h->width - tileX * ts), std::min(ts, h->height - tileY * ts),
+                     h->channels, size_t(h->stride)};
+}
+
+// ==================== IMAGEREGISTRY ====================
+std::shared_ptr<Image> ImageRegistry::load(const std::string& path, const LoadOptions& options) {
+    std::vector<unsigned char> bytes;
+    if (!readFile(path, bytes)) return nullptr;
+    // Images decoded with different LoadOptions (size limits, channel
+    // compaction, palette storage) must not alias each other
+    uint64_t key = xxHash64(bytes.data(), bytes.size()) ^
+                   (uint64_t(uint32_t(options.maxWidth)) << 32 | uint32_t(options.maxHeight)) * kPrime3 ^
+                   uint64_t((options.compactChannels ? 1 : 0) | (options.indexed ? 2 : 0)) * kPrime2;
+    // Differently seeded hash checked on every hit, so a key collision
+    // alone never hands back another file's image
+    const uint64_t check = xxHash64(bytes.data(), bytes.size(), kPrime4);
+
+    auto lookup = [&]() -> std::shared_ptr<Image> {
+        auto range = m_entries.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it)
+            if (it->second.fileSize == bytes.size() && it->second.check == check)
+                if (auto img = it->second.image.lock()) return img;
+        return nullptr;
+    };
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (auto img = lookup()) return img;
+    }
+
+    // Decode outside the lock; if another thread won the race, use its copy
+    auto img = std::make_shared<Image>();
+    if (!img->loadFromMemory(bytes.data(), bytes.size(), options)) return nullptr;
+    img->m_filePath = path;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (auto existing = lookup()) return existing;
+    // Drop entries whose images were released so the map tracks live images
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        if (it->second.image.expired()) it = m_entries.erase(it);
+        else ++it;
+    }
+    m_entries.insert({key, Entry{bytes.size(), check, img}});
+    return img;
+}
+
+size_t ImageRegistry::count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t live = 0;
+    for (const auto& entry : m_entries)
+        if (!entry.second.image.expired()) ++live;
+    return live;
+}
+
+void ImageRegistry::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+}
+
+uint64_t ImageRegistry::hashBytes(const void* data, size_t size) {
+    return xxHash64(static_cast<const unsigned char*>(data), size);
+}
+
+// ==================== PERCEPTUAL INDEX ====================
+int PerceptualIndex::distance(uint64_t a, uint64_t b) {
+    uint64_t x = a ^ b;
+    int bits = 0;
+    for (; x; x &= x - 1) ++bits;
+    return bits;
+}
+
+void PerceptualIndex::add(uint64_t hash, size_t id) {
+    m_nodes.push_back({hash, id, {}});
+    size_t added = m_nodes.size() - 1;
+    if (added == 0) return;
+
+    size_t node = 0;
+    for (;;) {
+        int d = distance(hash, m_nodes[node].hash);
+        auto& children = m_nodes[node].children;
+        auto it = std::find_if(children.begin(), children.end(),
+                               [d](const std::pair<int, size_t>& c) { return c.first == d; });
+        if (it == children.end()) {
+            children.push_back({d, added});
+            return;
+        }
+        node = it->second;
+    }
+}
+
+void PerceptualIndex::build(ImageList& list, HashType type) {
+    m_nodes.clear();
+    std::vector<std::shared_ptr<Image>> images(list.count());
+    for (size_t i = 0; i < images.size(); ++i) images[i] = list.at(i);
+
+    std::vector<uint64_t> hashes(images.size());
+    parallelFor(int(images.size()), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            if (images[i]) hashes[i] = images[i]->perceptualHash(type);
+    });
+    for (size_t i = 0; i < images.size(); ++i)
+        if (images[i]) add(hashes[i], i);
+}
+
+std::vector<size_t> PerceptualIndex::query(uint64_t hash, int radius) const {
+    std::vector<size_t> result = queryNodes(hash, radius);
+    for (size_t& i : result) i = m_nodes[i].id;
+    return result;
+}
+
+std::vector<size_t> PerceptualIndex::queryNodes(uint64_t hash, int radius) const {
+    std::vector<size_t> result;
+    if (m_nodes.empty()) return result;
+
+    std::vector<size_t> pending{0};
+    while (!pending.empty()) {
+        size_t index = pending.back();
+        const Node& node = m_nodes[index];
+        pending.pop_back();
+        int d = distance(hash, node.hash);
+        if (d <= radius) result.push_back(index);
+        // Triangle inequality: only subtrees at distance [d - r, d + r] can match
+        for (const auto& child : node.children)
+            if (child.first >= d - radius && child.first <= d + radius) pending.push_back(child.second);
+    }
+    return result;
+}
+
+std::vector<std::vector<size_t>> PerceptualIndex::duplicateGroups(int radius) const {
+    // Union-find over node indices, so groups are transitive
+    std::vector<size_t> parent(m_nodes.size());
+    for (size_t i = 0; i < parent.size(); ++i) parent[i] = i;
+    auto find = [&](size_t i) {
+        while (parent[i] != i) i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    for (size_t i = 0; i < m_nodes.size(); ++i)
+        for (size_t j : queryNodes(m_nodes[i].hash, radius)) {
+            size_t a = find(i), b = find(j);
+            if (a != b) parent[std::max(a, b)] = std::min(a, b);
+        }
+
+    std::vector<std::vector<size_t>> groups;
+    std::vector<size_t> groupOf(m_nodes.size(), SIZE_MAX);
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        size_t root = find(i);
+        if (groupOf[root] == SIZE_MAX) {
+            groupOf[root] = groups.size();
+            groups.emplace_back();
+        }
+        groups[groupOf[root]].push_back(m_nodes[i].id);
+    }
+    groups.erase(std::remove_if(groups.begin(), groups.end(),
+                                [](const std::vector<size_t>& g) { return g.size() < 2; }),
+                 groups.end());
+    return groups;
+}
+
+size_t PerceptualIndex::count() const { return m_nodes.size(); }
+
+// ==================== EDIT PIPELINE ====================
+EditPipeline::EditPipeline(int tileSize) : m_tileSize(std::max(16, tileSize)) {}
+
+void EditPipeline::setSource(const Image& source) {
+    m_source = source;
+    m_source.expandPalette();
+    for (size_t i = 0; i < m_steps.size(); ++i) m_steps[i].output = Image();
+    if (!m_steps.empty()) markAllDirty(0);
+    m_sourceEdits.assign(1, Rect{0, 0, m_source.m_width, m_source.m_height});
+}
+
+Image& EditPipeline::source() { return m_source; }
+
+void EditPipeline::invalidate(const Rect& region) {
+    if (m_steps.empty()) m_sourceEdits.push_back(region);
+    else markDirty(0, region);
+}
+
+size_t EditPipeline::addStep(Operation op, int radius) {
+    m_steps.push_back(Step());
+    m_steps.back().op = std::move(op);
+    m_steps.back().radius = radius;
+    markAllDirty(m_steps.size() - 1);
+    return m_steps.size() - 1;
+}
+
+void EditPipeline::setStep(size_t index, Operation op, int radius) {
+    if (index >= m_steps.size()) return;
+    m_steps[index].op = std::move(op);
+    m_steps[index].radius = radius;
+    markAllDirty(index);
+}
+
+void EditPipeline::removeStep(size_t index) {
+    if (index >= m_steps.size()) return;
+    m_steps.erase(m_steps.begin() + index);
+    if (index < m_steps.size()) markAllDirty(index);
+    else if (m_steps.empty()) m_sourceEdits.assign(1, Rect{0, 0, m_source.m_width, m_source.m_height});
+}
+
+size_t EditPipeline::stepCount() const { return m_steps.size(); }
+
+const Image& EditPipeline::inputOf(size_t index) const {
+    return index == 0 ? m_source : m_steps[index - 1].output;
+}
+
+const Image& EditPipeline::result() const { return m_steps.empty() ? m_source : m_steps.back().output; }
+
+const std::vector<Rect>& EditPipeline::changedRegions() const { return m_changed; }
+
+void EditPipeline::markAllDirty(size_t index) {
+    Step& step = m_steps[index];
+    const Image& in = inputOf(index);
+    step.tilesX = (in.m_width + m_tileSize - 1) / m_tileSize;
+    step.tilesY = (in.m_height + m_tileSize - 1) / m_tileSize;
+    step.dirty.assign(size_t(step.tilesX) * step.tilesY, 1);
+}
+
+// region is in the step's input coordinates; it is grown by the step's radius
+void EditPipeline::markDirty(size_t index, Rect region) {
+    Step& step = m_steps[index];
+    if (step.dirty.size() != size_t(step.tilesX) * step.tilesY || step.dirty.empty()) {
+        markAllDirty(index);
+        return;
+    }
+    int radius = std::max(0, step.radius);
+    const Image& in = inputOf(index);
+    int x0 = std::max(0, region.x - radius), y0 = std::max(0, region.y - radius);
+    int x1 = std::min(in.m_width, region.x + region.width + radius);
+    int y1 = std::min(in.m_height, region.y + region.height + radius);
+    for (int ty = y0 / m_tileSize; ty * m_tileSize < y1; ++ty)
+        for (int tx = x0 / m_tileSize; tx * m_tileSize < x1; ++tx) step.dirty[size_t(ty) * step.tilesX + tx] = 1;
+}
+
+bool EditPipeline::render() {
+    if (m_steps.empty()) {
+        m_changed = std::move(m_sourceEdits);
+        m_sourceEdits.clear();
+        return true;
+    }
+    m_changed.clear();
+    for (size_t i = 0; i < m_steps.size(); ++i)
+        if (!renderStep(i)) return false;
+    return true;
+}
+
+bool EditPipeline::renderStep(size_t index) {
+    Step& step = m_steps[index];
+    const Image& in = inputOf(index);
+    // The input may have been resized by an earlier whole-image step
+    if (step.tilesX != (in.m_width + m_tileSize - 1) / m_tileSize ||
+        step.tilesY != (in.m_height + m_tileSize - 1) / m_tileSize)
+        markAllDirty(index);
+    std::vector<int> tiles;
+    for (size_t t = 0; t < step.dirty.size(); ++t)
+        if (step.dirty[t]) tiles.push_back(int(t));
+    if (tiles.empty() || in.m_pixels.empty()) return true;
+
+    bool last = index + 1 == m_steps.size();
+    if (step.radius < 0) {
+        step.output = in;
+        step.op(step.output);
+        std::fill(step.dirty.begin(), step.dirty.end(), 0);
+        if (last) m_changed.assign(1, Rect{0, 0, step.output.m_width, step.output.m_height});
+        else markAllDirty(index + 1);
+        return true;
+    }
+
+    size_t inStride = size_t(in.m_width) * in.m_channels;
+    auto runTile = [&](int t, Image& tile, Rect& inner, int& innerX, int& innerY) {
+        int tx = t % step.tilesX, ty = t / step.tilesX;
+        inner = Rect{tx * m_tileSize, ty * m_tileSize, 0, 0};
+        inner.width = std::min(m_tileSize, in.m_width - inner.x);
+        inner.height = std::min(m_tileSize, in.m_height - inner.y);
+        int x0 = std::max(0, inner.x - step.radius), y0 = std::max(0, inner.y - step.radius);
+        int x1 = std::min(in.m_width, inner.x + inner.width + step.radius);
+        int y1 = std::min(in.m_height, inner.y + inner.height + step.radius);
+        tile.loadFromView(ImageView{&in.m_pixels[y0 * inStride + size_t(x0) * in.m_channels], x1 - x0, y1 - y0,
+                                    in.m_channels, inStride});
+        step.op(tile);
+        innerX = inner.x - x0;
+        innerY = inner.y - y0;
+        return tile.m_width == x1 - x0 && tile.m_height == y1 - y0 && !tile.isIndexed();
+    };
+    auto store = [&](const Image& tile, const Rect& inner, int innerX, int innerY) {
+        Image& out = step.output;
+        size_t rowBytes = size_t(inner.width) * out.m_channels;
+        for (int y = 0; y < inner.height; ++y)
+            std::memcpy(&out.m_pixels[(size_t(inner.y + y) * out.m_width + inner.x) * out.m_channels],
+                        &tile.m_pixels[(size_t(innerY + y) * tile.m_width + innerX) * tile.m_channels], rowBytes);
+    };
+
+    // The first tile fixes the output channel count; a cache of another
+    // shape is reallocated and then every tile has to be recomputed
+    Image first;
+    Rect inner;
+    int innerX, innerY;
+    if (!runTile(tiles[0], first, inner, innerX, innerY)) return false;
+    Image& out = step.output;
+    bool reallocated = out.m_width != in.m_width || out.m_height != in.m_height ||
+                       out.m_channels != first.m_channels;
+    if (reallocated) {
+        out = Image();
+        out.m_width = in.m_width;
+        out.m_height = in.m_height;
+        out.m_channels = first.m_channels;
+        out.m_pixels.resize(size_t(in.m_width) * in.m_height * first.m_channels);
+        // tiles[0] is already rendered into `first`; the rest follow it
+        int firstTile = tiles[0];
+        tiles.assign(1, firstTile);
+        for (int t = 0; t < int(step.dirty.size()); ++t)
+            if (t != firstTile) tiles.push_back(t);
+    }
+    store(first, inner, innerX, innerY);
+
+    std::atomic<bool> ok(true);
+    parallelFor(int(tiles.size()) - 1, [&](int begin, int end) {
+        Image tile;
+        Rect r;
+        int ix, iy;
+        for (int i = begin + 1; i <= end && ok; ++i) {
+            if (!runTile(tiles[i], tile, r, ix, iy) || tile.m_channels != out.m_channels) {
+                ok = false;
+                break;
+            }
+            store(tile, r, ix, iy);
+        }
+    });
+    if (!ok) return false;
+
+    std::vector<char> done(step.dirty.size(), 0);
+    for (int t : tiles) done[t] = 1;
+    // A fresh cache is only valid once every tile has been written
+    if (reallocated && std::find(done.begin(), done.end(), 0) != done.end()) return false;
+    std::fill(step.dirty.begin(), step.dirty.end(), 0);
+    auto runs = dirtyRuns(done, in.m_width, in.m_height, m_tileSize);
+    if (last) m_changed = std::move(runs);
+    else
+        for (const auto& r : runs) markDirty(index + 1, r);
+    return true;
+}
+
+// ==================== EDIT HISTORY ====================
+namespace {
+
+// Bounds of tile `index` in a width x height image
+Rect tileBounds(int index, int tileSize, int width, int height) {
+    int tilesX = (width + tileSize - 1) / tileSize;
+    Rect r{(index % tilesX) * tileSize, (index / tilesX) * tileSize, 0, 0};
+    r.width = std::min(tileSize, width - r.x);
+    r.height = std::min(tileSize, height - r.y);
+    return r;
+}
+
+void copyTileOut(const unsigned char* px, int width, int channels, const Rect& r, std::vector<unsigned char>& out) {
+    size_t rowBytes = size_t(r.width) * channels;
+    out.resize(rowBytes * r.height);
+    for (int y = 0; y < r.height; ++y)
+        std::memcpy(&out[y * rowBytes], px + (size_t(r.y + y) * width + r.x) * channels, rowBytes);
+}
+
+// Decodes a QOI tile back into the image; 1- and 2-channel tiles were
+// stored as RGB / RGBA, so only R (and A) are copied back
+bool copyTileIn(unsigned char* px, int width, int channels, const Rect& r, const std::vector<unsigned char>& encoded) {
+    std::vector<unsigned char> decoded;
+    int w, h, c;
+    if (!qoiDecode(encoded.data(), encoded.size(), decoded, w, h, c) || w != r.width || h != r.height) return false;
+    for (int y = 0; y < r.height; ++y) {
+        unsigned char* dst = px + (size_t(r.y + y) * width + r.x) * channels;
+        const unsigned char* src = &decoded[size_t(y) * w * c];
+        if (channels == c) {
+            std::memcpy(dst, src, size_t(w) * c);
+            continue;
+        }
+        for (int x = 0; x < w; ++x, dst += channels, src += c) {
+            dst[0] = src[0];
+            if (channels == 2) dst[1] = src[3];
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+EditHistory::EditHistory(Image& image, int tileSize) : m_image(image), m_tileSize(std::max(8, tileSize)) {}
+
+EditHistory::Frame EditHistory::currentFrame() const {
+    Frame frame;
+    frame.width = m_image.m_width;
+    frame.height = m_image.m_height;
+    frame.channels = m_image.m_channels;
+    frame.palette = m_image.m_palette;
+    frame.paletteChannels = m_image.m_paletteChannels;
+    return frame;
+}
+
+void EditHistory::beginEdit() { beginEdit(Rect{0, 0, m_image.m_width, m_image.m_height}); }
+
+void EditHistory::beginEdit(const Rect& region) {
+    m_editing = true;
+    m_pendingFrame = currentFrame();
+    m_pending.clear();
+    const Frame& f = m_pendingFrame;
+    if (f.width <= 0 || f.height <= 0) return;
+    int x0 = std::max(0, region.x), y0 = std::max(0, region.y);
+    int x1 = std::min(f.width, region.x + region.width), y1 = std::min(f.height, region.y + region.height);
+    int tilesX = (f.width + m_tileSize - 1) / m_tileSize;
+    for (int ty = y0 / m_tileSize; ty * m_tileSize < y1; ++ty)
+        for (int tx = x0 / m_tileSize; tx * m_tileSize < x1; ++tx)
+            m_pending.emplace_back(ty * tilesX + tx, std::vector<unsigned char>());
+    parallelFor(int(m_pending.size()), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            copyTileOut(m_image.m_pixels.data(), f.width, f.channels,
+                        tileBounds(m_pending[i].first, m_tileSize, f.width, f.height), m_pending[i].second);
+    });
+}
+
+void EditHistory::endEdit() {
+    if (!m_editing) return;
+    m_editing = false;
+    Step step;
+    step.before = std::move(m_pendingFrame);
+    step.after = currentFrame();
+    const Frame& b = step.before;
+    const Frame& a = step.after;
+    bool resized = a.width != b.width || a.height != b.height || a.channels != b.channels;
+    if (resized) {
+        int tiles = ((b.width + m_tileSize - 1) / m_tileSize) * ((b.height + m_tileSize - 1) / m_tileSize);
+        if (int(m_pending.size()) != tiles) {
+            // A region edit that resized the image cannot be undone
+            m_pending.clear();
+            clear();
+            return;
+        }
+    }
+
+    // Which tiles changed; every tile when the layout changed
+    std::vector<char> changed(m_pending.size(), 1);
+    if (!resized) {
+        parallelFor(int(m_pending.size()), [&](int begin, int end) {
+            std::vector<unsigned char> now;
+            for (int i = begin; i < end; ++i) {
+                copyTileOut(m_image.m_pixels.data(), a.width, a.channels,
+                            tileBounds(m_pending[i].first, m_tileSize, a.width, a.height), now);
+                changed[i] = now != m_pending[i].second;
+            }
+        });
+    }
+    for (size_t i = 0; i < m_pending.size(); ++i)
+        if (changed[i]) step.beforeTiles.push_back(Tile{m_pending[i].first, {}});
+    if (resized) {
+        int tiles = ((a.width + m_tileSize - 1) / m_tileSize) * ((a.height + m_tileSize - 1) / m_tileSize);
+        for (int t = 0; t < tiles; ++t) step.afterTiles.push_back(Tile{t, {}});
+    } else {
+        for (const auto& t : step.beforeTiles) step.afterTiles.push_back(Tile{t.index, {}});
+    }
+    if (step.beforeTiles.empty() && step.afterTiles.empty() && a.palette == b.palette &&
+        a.paletteChannels == b.paletteChannels) {
+        m_pending.clear();
+        return;
+    }
+
+    std::vector<int> pendingSlot(m_pending.size());
+    for (size_t i = 0, j = 0; i < m_pending.size(); ++i)
+        if (changed[i]) pendingSlot[j++] = int(i);
+    parallelFor(int(step.beforeTiles.size()), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            Rect r = tileBounds(step.beforeTiles[i].index, m_tileSize, b.width, b.height);
+            qoiEncode(m_pending[pendingSlot[i]].second.data(), r.width, r.height, b.channels,
+                      step.beforeTiles[i].encoded);
+        }
+    });
+    parallelFor(int(step.afterTiles.size()), [&](int begin, int end) {
+        std::vector<unsigned char> raw;
+        for (int i = begin; i < end; ++i) {
+            Rect r = tileBounds(step.afterTiles[i].index, m_tileSize, a.width, a.height);
+            copyTileOut(m_image.m_pixels.data(), a.width, a.channels, r, raw);
+            qoiEncode(raw.data(), r.width, r.height, a.channels, step.afterTiles[i].encoded);
+        }
+    });
+    m_pending.clear();
+
+    step.bytes = b.palette.size() + a.palette.size();
+    for (const auto& t : step.beforeTiles) step.bytes += t.encoded.size();
+    for (const auto& t : step.afterTiles) step.bytes += t.encoded.size();
+    m_undo.push_back(std::move(step));
+    m_redo.clear();
+    enforceLimit();
+}
+
+void EditHistory::applyFrame(const Frame& frame, const std::vector<Tile>& tiles) {
+    Image& img = m_image;
+    if (img.m_width != frame.width || img.m_height != frame.height || img.m_channels != frame.channels) {
+        img.m_width = frame.width;
+        img.m_height = frame.height;
+        img.m_channels = frame.channels;
+        img.m_pixels.assign(size_t(frame.width) * frame.height * frame.channels, 0);
+    }
+    img.m_palette = frame.palette;
+    img.m_paletteChannels = frame.paletteChannels;
+    parallelFor(int(tiles.size()), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            copyTileIn(img.m_pixels.data(), frame.width, frame.channels,
+                       tileBounds(tiles[i].index, m_tileSize, frame.width, frame.height), tiles[i].encoded);
+    });
+}
+
+bool EditHistory::undo() {
+    if (m_undo.empty() || m_editing) return false;
+    Step& step = m_undo.back();
+    applyFrame(step.before, step.beforeTiles);
+    m_redo.push_back(std::move(step));
+    m_undo.pop_back();
+    return true;
+}
+
+bool EditHistory::redo() {
+    if (m_redo.empty() || m_editing) return false;
+    Step& step = m_redo.back();
+    applyFrame(step.after, step.afterTiles);
+    m_undo.push_back(std::move(step));
+    m_redo.pop_back();
+    return true;
+}
+
+bool EditHistory::canUndo() const { return !m_undo.empty(); }
+bool EditHistory::canRedo() const { return !m_redo.empty(); }
+
+void EditHistory::clear() {
+    m_undo.clear();
+    m_redo.clear();
+}
+
+size_t EditHistory::memoryUsage() const {
+    size_t bytes = 0;
+    for (const auto& step : m_undo) bytes += step.bytes;
+    for (const auto& step : m_redo) bytes += step.bytes;
+    return bytes;
+}
+
+void EditHistory::setMemoryLimit(size_t bytes) {
+    m_limit = bytes;
+    enforceLimit();
+}
+
+void EditHistory::enforceLimit() {
+    if (m_limit == 0) return;
+    size_t bytes = memoryUsage();
+    size_t drop = 0;
+    while (drop < m_undo.size() && bytes > m_limit) bytes -= m_undo[drop++].bytes;
+    m_undo.erase(m_undo.begin(), m_undo.begin() + drop);
+}
 
 } // namespace yiv
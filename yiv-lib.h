@@ -12,42 +12,407 @@
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <cstdint>
+#include <unordered_map>
+#include <functional>
 
 namespace yiv {
 
 enum class FilterType { Grayscale, Invert, Brightness, Contrast };
-enum class ImageFormat { PNG, JPEG, BMP, GIF, TIFF, WEBP, HEIF };
+enum class ImageFormat { PNG, JPEG, BMP, GIF, TIFF, WEBP, HEIF, TGA, QOI };
+enum class HashType { Average, Difference, Perceptual };
+enum class ThresholdMethod { Otsu, Sauvola, Bradley };
+enum class MorphOp { Erode, Dilate, Open, Close };
+enum class GradientOperator { Sobel, Scharr };
+// Fit: inside the box, aspect kept; Cover: fills the box, centre-cropped;
+// Stretch: exactly the box, aspect ignored
+enum class FitMode { Fit, Cover, Stretch };
+enum class ToneMapOperator { Reinhard, AcesFilmic };
+
+struct Rect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Placeholder color; weight is the share of the image it represents (0..1)
+struct Color {
+    unsigned char r = 0;
+    unsigned char g = 0;
+    unsigned char b = 0;
+    float weight = 0;
+};
+
+// Pan/zoom state for rendering: zoom is output pixels per image pixel and
+// (x, y) the image coordinate shown at the viewport's top-left corner
+struct Viewport {
+    double zoom = 1.0;
+    double x = 0.0;
+    double y = 0.0;
+};
+
+// Per-label statistics from labelComponents; stats[i] describes label i + 1
+struct ComponentStats {
+    Rect bounds;
+    int area = 0;
+    double centroidX = 0;
+    double centroidY = 0;
+};
+
+// Non-owning view of interleaved 8-bit pixels; stride is in bytes
+struct ImageView {
+    const unsigned char* data = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    size_t stride = 0;
+};
+
+// Options applied while decoding. maxWidth/maxHeight (0 = unlimited) shrink
+// the image right after decode so only the reduced copy is kept.
+// compactChannels runs compactChannels() and indexed runs toIndexed() on the result.
+struct LoadOptions {
+    int maxWidth = 0;
+    int maxHeight = 0;
+    bool compactChannels = false;
+    bool indexed = false;
+};
+
+// One output of Image::generateThumbnails; written to `path` when it is set
+struct ThumbnailSpec {
+    int width = 0;
+    int height = 0;
+    FitMode mode = FitMode::Fit;
+    ImageFormat format = ImageFormat::JPEG;
+    std::string path;
+};
 
 class Image {
 public:
     Image() = default;
     ~Image() = default;
 
-    bool loadFromFile(const std::string& path);
+    bool loadFromFile(const std::string& path, const LoadOptions& options = LoadOptions());
+    bool loadFromMemory(const unsigned char* bytes, size_t size, const LoadOptions& options = LoadOptions());
+    bool loadFromView(const ImageView& view);
     int width() const;
     int height() const;
     const unsigned char* data() const;
+    ImageView view() const;
 
     void rotateClockwise();
     void rotateCounterClockwise();
     void scale(float factor);
+    // In-place variants that never allocate a second pixel buffer (90 degree
+    // rotations use a cycle-following transpose with a one-bit-per-pixel
+    // visited map). scaleInPlace area-averages into the front of the buffer
+    // and only shrinks; its capacity is kept.
+    void rotateClockwiseInPlace();
+    void rotateCounterClockwiseInPlace();
+    void rotate180();
+    void flipHorizontal();
+    void flipVertical();
+    void scaleInPlace(float factor);
+    bool crop(int x, int y, int width, int height);
+    // Area/linear resample of only the needed source region, in one pass
+    void resize(int width, int height, FitMode mode = FitMode::Stretch);
 
     // New features
-    bool hasAlpha() const;
+    bool hasAlpha() const; // true only if some pixel is not fully opaque
+    int channels() const;
+    // Drops an all-opaque alpha channel and collapses R==G==B to one gray
+    // channel; returns true if the channel count was reduced
+    bool compactChannels();
+    // Palette storage: one byte per pixel indexing up to 256 colors. While
+    // indexed, data()/view() expose the indices and channels() the palette
+    // entry size. Rotate, crop, scale and filters work without expanding.
+    bool isIndexed() const;
+    const std::vector<unsigned char>& palette() const;
+    bool toIndexed(); // false if the image has more than 256 colors
+    void expandPalette();
     std::string getMetadata(const std::string& key) const;
     void applyFilter(FilterType type);
     bool saveAs(const std::string& path, ImageFormat format);
+    bool saveToMemory(std::vector<unsigned char>& out, ImageFormat format) const;
+    // Uncompressed .yiv container (64-byte aligned rows, or tiles of at most
+    // 65536 when tileSize > 0)
+    bool saveRaw(const std::string& path, int tileSize = 0) const;
     std::shared_ptr<Image> generateThumbnail(int maxWidth, int maxHeight);
+    // Bilinear render of only the visible pixels into a caller framebuffer
+    // (3 = RGB or 4 = RGBA bytes per pixel); see ImagePyramid::render
+    bool renderViewport(const Viewport& viewport, unsigned char* dst, int dstWidth, int dstHeight,
+                        size_t dstStride, int dstChannels = 4) const;
+    // Exact width x height thumbnail cropped around the most salient region
+    // (edge energy + saturation measured on a small preview)
+    std::shared_ptr<Image> generateSmartThumbnail(int width, int height);
+    Rect smartCropRect(int width, int height) const;
+    // Several sizes at once: outputs are resampled from a halving cascade
+    // (each from the smallest level still at least as large) and saved in
+    // parallel. The static overload decodes the file once, already reduced.
+    // An entry is null when its spec is empty or its file could not be saved.
+    std::vector<std::shared_ptr<Image>> generateThumbnails(const std::vector<ThumbnailSpec>& specs) const;
+    static std::vector<std::shared_ptr<Image>> generateThumbnails(const std::string& path,
+                                                                  const std::vector<ThumbnailSpec>& specs);
     bool loadPartial(const std::string& path, int x, int y, int width, int height);
 
+    // Binarization to one 0/255 channel. window and k only apply to the
+    // adaptive methods (Sauvola: k ~0.2-0.5, Bradley: k ~0.15)
+    int otsuThreshold() const;
+    void binarize(ThresholdMethod method, int window = 31, float k = 0.2f);
+
+    // Rectangular min/max filters per channel; cost per pixel does not
+    // depend on the kernel size. Pixels outside the image are ignored.
+    void morphology(MorphOp op, int kernelWidth, int kernelHeight);
+
+    // Denoising. medianFilter uses per-column histograms (Perreault-Hebert),
+    // constant time per pixel in the radius; bilateralFilter is the
+    // bilateral-grid approximation (sigmas in pixels and gray levels; both
+    // are raised as needed to keep the grid near the image size)
+    void medianFilter(int radius);
+    void bilateralFilter(float sigmaSpatial, float sigmaRange);
+
+    // Gradients of the luma channel. Magnitudes are normalised by the kernel
+    // weight (0..~361); orientation is atan2(gy, gx) in radians.
+    void gradients(GradientOperator op, std::vector<float>& magnitude, std::vector<float>& orientation) const;
+    std::shared_ptr<Image> gradientMagnitude(GradientOperator op = GradientOperator::Sobel) const;
+    // Canny edges (1 channel, 0/255); thresholds use the magnitude scale above
+    std::shared_ptr<Image> detectEdges(float lowThreshold, float highThreshold,
+                                       GradientOperator op = GradientOperator::Sobel) const;
+
+    // Labels non-black pixels; labels[y * width + x] is 0 for background or
+    // 1..n. Returns n. Bands are labelled in parallel, then stitched.
+    int labelComponents(std::vector<uint32_t>& labels, std::vector<ComponentStats>& stats,
+                        bool eightConnected = true) const;
+
+    // Placeholders for progressive loading. All of them work on a sampled
+    // preview of at most 32x32 (a fixed number of reads per preview pixel),
+    // so the cost does not depend on the image size.
+    Color dominantColor() const;
+    std::vector<Color> dominantColors(int count) const; // most common first
+    std::string blurHash(int componentsX = 4, int componentsY = 3) const; // 1..9 each
+    // "data:image/jpeg;base64,..." of a tiny JPEG (longest side maxSize)
+    std::string lqipDataUri(int maxSize = 16, int quality = 40) const;
+
+    // Change detection for incremental export/sync. Tiles are tileSize
+    // squares in row-major order (edge tiles are clipped); dirty tiles are
+    // merged into horizontal runs. Images of different size or channel count
+    // are entirely dirty. tileHashes lets the previous version be dropped.
+    std::vector<uint64_t> tileHashes(int tileSize = 64) const;
+    std::vector<Rect> changedTiles(const std::vector<uint64_t>& previousHashes, int tileSize = 64) const;
+    std::vector<Rect> diffTiles(const Image& other, int tileSize = 64) const;
+    // Per-channel absolute difference (nullptr if the sizes differ)
+    std::shared_ptr<Image> diffImage(const Image& other) const;
+
+    // 64-bit perceptual hash (aHash, dHash or DCT-based pHash)
+    uint64_t perceptualHash(HashType type) const;
+    // xxHash64 of the encoded file bytes, set by loadFromFile/loadFromMemory
+    uint64_t contentHash() const;
+
 private:
     int m_width = 0;
     int m_height = 0;
     int m_channels = 0;
     std::vector<unsigned char> m_pixels;
     std::string m_filePath;
+    uint64_t m_contentHash = 0;
+    std::vector<unsigned char> m_palette; // m_paletteChannels bytes per entry
+    int m_paletteChannels = 0;
 
     void updatePixelData(const unsigned char* data, int width, int height, int channels);
+    void assignDecoded(const unsigned char* data, int width, int height, int channels,
+                       const LoadOptions& options);
+    void erodeOrDilate(bool erode, int kernelWidth, int kernelHeight);
+    void gradientXY(GradientOperator op, std::vector<float>& gx, std::vector<float>& gy) const;
+    // Output sizes and crops are fitted to fitWidth x fitHeight (the
+    // original size when this image was decoded reduced)
+    std::vector<std::shared_ptr<Image>> generateThumbnails(const std::vector<ThumbnailSpec>& specs,
+                                                           int fitWidth, int fitHeight) const;
+
+    friend class ImageRegistry;
+    friend class BitImage;
+    friend class EditPipeline;
+    friend class EditHistory;
+    friend class TiledImage;
+    friend class ImagePyramid;
+    friend class HdrImage;
+    friend class RawImage;
+};
+
+// Packed 1-bit image, MSB first, 1 = white. Rows are padded to 64-bit
+// words (padding bits stay zero) so kernels can work a word at a time.
+class BitImage {
+public:
+    BitImage() = default;
+    BitImage(int width, int height); // all black
+    ~BitImage() = default;
+
+    static std::shared_ptr<BitImage> fromImage(const Image& image, int threshold = 128);
+    static std::shared_ptr<BitImage> binarize(const Image& image, ThresholdMethod method,
+                                              int window = 31, float k = 0.2f);
+    std::shared_ptr<Image> toImage() const; // 1 channel, 0 or 255
+
+    int width() const;
+    int height() const;
+    size_t stride() const; // bytes per row
+    const unsigned char* data() const;
+    unsigned char* data();
+    bool get(int x, int y) const;
+    void set(int x, int y, bool white);
+
+    void rotateClockwise();
+    void rotateCounterClockwise();
+    void flipHorizontal();
+    void flipVertical();
+    bool crop(int x, int y, int width, int height);
+    // Each factor x factor block becomes one gray pixel (fraction of white bits)
+    std::shared_ptr<Image> scaleToGray(int factor) const;
+    // Erode/dilate act on white (1) bits, a 64-bit word at a time
+    void morphology(MorphOp op, int kernelWidth, int kernelHeight);
+    // Same as Image::labelComponents with white bits as foreground
+    int labelComponents(std::vector<uint32_t>& labels, std::vector<ComponentStats>& stats,
+                        bool eightConnected = true) const;
+    bool saveAs(const std::string& path, ImageFormat format) const; // PNG or TIFF
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    size_t m_stride = 0;
+    std::vector<unsigned char> m_bits;
+
+    void transpose();
+    void clearPadding();
+    void erodeOrDilate(bool erode, int kernelWidth, int kernelHeight);
+};
+
+// Mip chain for pan/zoom viewing: level 0 is the image, each next level is
+// a 2x2 box-filtered half, down to minSize on the shorter side
+class ImagePyramid {
+public:
+    ImagePyramid() = default;
+    ~ImagePyramid() = default;
+
+    static std::shared_ptr<ImagePyramid> build(const Image& image, int minSize = 64);
+
+    size_t levels() const;
+    const Image& level(size_t index) const;
+    int width() const; // of level 0
+    int height() const;
+
+    // Samples the smallest level that still has a pixel per output pixel,
+    // so a bilinear tap never skips more than one level pixel. Pixels
+    // outside the image are cleared to 0; rows are rendered in parallel.
+    bool render(const Viewport& viewport, unsigned char* dst, int dstWidth, int dstHeight,
+                size_t dstStride, int dstChannels = 4) const;
+
+private:
+    std::vector<Image> m_levels;
+};
+
+// Pixels stored as square tiles, each contiguous and row-major (edge tiles
+// are padded to full size). Rotation and resampling read only a few tiles
+// per output tile, so access locality does not depend on the direction.
+// Convert with fromImage/toImage at I/O boundaries.
+class TiledImage {
+public:
+    TiledImage() = default;
+    ~TiledImage() = default;
+
+    static std::shared_ptr<TiledImage> fromImage(const Image& image, int tileSize = 64);
+    std::shared_ptr<Image> toImage() const;
+
+    int width() const;
+    int height() const;
+    int channels() const;
+    int tileSize() const;
+    int tilesX() const;
+    int tilesY() const;
+    const unsigned char* tile(int tileX, int tileY) const; // tileSize * tileSize pixels
+    unsigned char* tile(int tileX, int tileY);
+    const unsigned char* pixel(int x, int y) const;
+
+    // Each output tile is built in one pass from its source tiles, in parallel
+    void rotateClockwise();
+    void rotateCounterClockwise();
+    void scale(float factor); // area average when shrinking, nearest when enlarging
+    void applyFilter(FilterType type);
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+    int m_tileSize = 0;
+    int m_tilesX = 0;
+    int m_tilesY = 0;
+    std::vector<unsigned char> m_tiles;
+
+    size_t tileBytes() const;
+    void allocate(int width, int height, int channels, int tileSize);
+    void rotate(bool clockwise);
+};
+
+// Linear float RGB/RGBA pixels from Radiance .hdr (via stb) or OpenEXR
+// (single-part scanline files: NONE, RLE, ZIPS or ZIP compression with
+// HALF, FLOAT or UINT channels R, G, B[, A] or luminance Y)
+class HdrImage {
+public:
+    HdrImage() = default;
+    ~HdrImage() = default;
+
+    static std::shared_ptr<HdrImage> loadFromFile(const std::string& path);
+    static std::shared_ptr<HdrImage> loadFromMemory(const unsigned char* bytes, size_t size);
+
+    int width() const;
+    int height() const;
+    int channels() const; // 3 or 4
+    const std::vector<float>& data() const;
+
+    // 8-bit sRGB display image; exposure is in stops
+    std::shared_ptr<Image> toneMap(ToneMapOperator op, float exposure = 0.0f) const;
+    // Area-averages the linear values first, then tone maps only the result
+    std::shared_ptr<Image> toneMappedThumbnail(int maxWidth, int maxHeight, ToneMapOperator op,
+                                               float exposure = 0.0f) const;
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+    std::vector<float> m_pixels;
+
+    bool loadExr(const unsigned char* bytes, size_t size);
+};
+
+// Bayer raw data from DNG (and other TIFF-based raw files with
+// uncompressed or lossless-JPEG CFA data), developed to 8-bit sRGB
+class RawImage {
+public:
+    RawImage() = default;
+    ~RawImage() = default;
+
+    static std::shared_ptr<RawImage> loadFromFile(const std::string& path);
+    static std::shared_ptr<RawImage> loadFromMemory(const unsigned char* bytes, size_t size);
+    // Fast path: the largest embedded JPEG preview, decoded; nullptr if none
+    static std::shared_ptr<Image> extractPreview(const std::string& path);
+    static std::shared_ptr<Image> extractPreview(const unsigned char* bytes, size_t size);
+
+    int width() const;
+    int height() const;
+    const std::vector<uint16_t>& data() const; // one CFA sample per pixel
+
+    // Bilinear demosaic, white balance (AsShotNeutral), camera-to-sRGB matrix
+    // (from ColorMatrix2/1) and gamma in one row-parallel pass. halfSize
+    // turns each 2x2 CFA block into one pixel instead of interpolating.
+    std::shared_ptr<Image> develop(bool halfSize = false) const;
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<uint16_t> m_cfa;
+    int m_pattern[4] = {0, 1, 1, 2}; // color (0 R, 1 G, 2 B) at (y & 1) * 2 + (x & 1)
+    float m_black[4] = {0, 0, 0, 0};
+    float m_white = 65535;
+    float m_gains[3] = {1, 1, 1};
+    float m_matrix[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1}; // camera RGB to linear sRGB
 };
 
 class ImageList {
@@ -71,4 +436,214 @@ private:
     mutable std::mutex m_mutex; // thread safety
 };
 
+// Pixel buffer in a POSIX shared-memory segment (a Linux memfd when the
+// name is empty). Other processes attach read-only by name or by fd.
+class SharedImage {
+public:
+    ~SharedImage();
+    SharedImage(const SharedImage&) = delete; // owns the mapping and fd
+    SharedImage& operator=(const SharedImage&) = delete;
+
+    static std::shared_ptr<SharedImage> create(const std::string& name, int width, int height, int channels);
+    static std::shared_ptr<SharedImage> create(const std::string& name, const Image& image);
+    static std::shared_ptr<SharedImage> createFromFile(const std::string& name, const std::string& path);
+    static std::shared_ptr<SharedImage> attach(const std::string& name);
+    static std::shared_ptr<SharedImage> attach(int fd);
+
+    ImageView view() const;
+    unsigned char* data(); // nullptr for read-only attachments
+    int fd() const;
+    const std::string& name() const;
+    void unlink(); // removes the name; existing mappings stay valid
+
+private:
+    SharedImage() = default;
+    static std::shared_ptr<SharedImage> map(int fd, const std::string& name, size_t size, bool writable);
+
+    std::string m_name;
+    int m_fd = -1;
+    void* m_mapping = nullptr;
+    size_t m_size = 0;
+    bool m_writable = false;
+};
+
+// Read-only memory mapping of a .yiv container written by Image::saveRaw.
+// Pixels are used in place; nothing is decoded or copied.
+class MappedImage {
+public:
+    ~MappedImage();
+    MappedImage(const MappedImage&) = delete; // owns the mapping
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    static std::shared_ptr<MappedImage> open(const std::string& path);
+
+    int width() const;
+    int height() const;
+    int channels() const;
+    int tileSize() const; // 0 for row-major files
+    ImageView view() const; // whole image; empty for tiled files
+    ImageView tile(int tileX, int tileY) const;
+
+private:
+    MappedImage() = default;
+
+    void* m_mapping = nullptr;
+    size_t m_size = 0;
+};
+
+// Shares one decoded Image between byte-identical files loaded with the
+// same LoadOptions. Returned images may be aliased by other paths, so copy
+// before modifying them.
+class ImageRegistry {
+public:
+    ImageRegistry() = default;
+    ~ImageRegistry() = default;
+
+    std::shared_ptr<Image> load(const std::string& path, const LoadOptions& options = LoadOptions());
+    size_t count() const; // images still held by a caller
+    void clear();
+
+    static uint64_t hashBytes(const void* data, size_t size);
+
+private:
+    struct Entry {
+        size_t fileSize;
+        uint64_t check; // second, differently seeded hash of the bytes
+        std::weak_ptr<Image> image;
+    };
+    std::unordered_multimap<uint64_t, Entry> m_entries;
+    mutable std::mutex m_mutex;
+};
+
+// BK-tree over 64-bit perceptual hashes for Hamming-radius queries
+class PerceptualIndex {
+public:
+    PerceptualIndex() = default;
+    ~PerceptualIndex() = default;
+
+    void add(uint64_t hash, size_t id);
+    void build(ImageList& list, HashType type); // replaces the index; ids are list indices
+    std::vector<size_t> query(uint64_t hash, int radius) const;
+    std::vector<std::vector<size_t>> duplicateGroups(int radius) const;
+    size_t count() const;
+
+    static int distance(uint64_t a, uint64_t b);
+
+private:
+    struct Node {
+        uint64_t hash;
+        size_t id;
+        std::vector<std::pair<int, size_t>> children; // (distance, node index)
+    };
+    std::vector<Node> m_nodes;
+
+    std::vector<size_t> queryNodes(uint64_t hash, int radius) const; // node indices
+};
+
+// Chain of edits with a cached result per step. Changing a step or editing
+// a region of the source only recomputes the affected tiles of each later
+// step; the dirty area grows by each step's radius (its kernel footprint:
+// 0 for applyFilter, r for medianFilter(r), ...). Local steps run on a tile
+// plus halo, must keep its size and may run on several tiles at once. A
+// negative radius marks a whole-image step (e.g. scale), rerun in full
+// whenever any of its input changed.
+class EditPipeline {
+public:
+    using Operation = std::function<void(Image&)>;
+
+    explicit EditPipeline(int tileSize = 256);
+    ~EditPipeline() = default;
+
+    void setSource(const Image& source);
+    Image& source(); // edit in place, then call invalidate()
+    void invalidate(const Rect& region);
+
+    size_t addStep(Operation op, int radius = 0);
+    void setStep(size_t index, Operation op, int radius = 0);
+    void removeStep(size_t index);
+    size_t stepCount() const;
+
+    // false if a local step changed the size of a tile
+    bool render();
+    const Image& result() const;
+    // Result areas recomputed by the last render
+    const std::vector<Rect>& changedRegions() const;
+
+private:
+    struct Step {
+        Operation op;
+        int radius = 0;
+        Image output;
+        std::vector<char> dirty; // per tile of the step's input
+        int tilesX = 0;
+        int tilesY = 0;
+    };
+    int m_tileSize;
+    Image m_source;
+    std::vector<Step> m_steps;
+    std::vector<Rect> m_sourceEdits; // reported as-is while there are no steps
+    std::vector<Rect> m_changed;
+
+    const Image& inputOf(size_t index) const;
+    void markDirty(size_t index, Rect region);
+    void markAllDirty(size_t index);
+    bool renderStep(size_t index);
+};
+
+// Undo/redo for an Image edited in place. Each step keeps only the tiles
+// the edit actually changed, before and after, QOI-compressed, so undo and
+// redo cost O(changed tiles). Wrap every edit in beginEdit/endEdit; the
+// region form promises that nothing outside it changes. Edits that change
+// the size keep every tile and need the whole-image form.
+class EditHistory {
+public:
+    explicit EditHistory(Image& image, int tileSize = 64);
+    ~EditHistory() = default;
+
+    void beginEdit();
+    void beginEdit(const Rect& region);
+    void endEdit();
+
+    bool undo();
+    bool redo();
+    bool canUndo() const;
+    bool canRedo() const;
+    void clear();
+
+    size_t memoryUsage() const; // compressed bytes held by all steps
+    // Oldest steps are dropped while memoryUsage() exceeds the limit (0 = none)
+    void setMemoryLimit(size_t bytes);
+
+private:
+    struct Frame {
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        std::vector<unsigned char> palette;
+        int paletteChannels = 0;
+    };
+    struct Tile {
+        int index; // row-major within the frame it belongs to
+        std::vector<unsigned char> encoded;
+    };
+    struct Step {
+        Frame before, after;
+        std::vector<Tile> beforeTiles, afterTiles;
+        size_t bytes = 0;
+    };
+
+    Image& m_image;
+    int m_tileSize;
+    size_t m_limit = 0;
+    std::vector<Step> m_undo, m_redo;
+    // Raw copies of the tiles taken by beginEdit, until endEdit
+    bool m_editing = false;
+    Frame m_pendingFrame;
+    std::vector<std::pair<int, std::vector<unsigned char>>> m_pending;
+
+    Frame currentFrame() const;
+    void applyFrame(const Frame& frame, const std::vector<Tile>& tiles);
+    void enforceLimit();
+};
+
 } // namespace yiv